@@ -0,0 +1,199 @@
+#include "had.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace had;
+
+DECLARE_ADGRAPH();
+
+// Build with e.g.
+//   g++ -O2 -std=c++11 bench.cpp -o bench && ./bench > bench_output.txt
+// and with -DNO_AATREE (plain binary trees) or -DUSE_HASHMAP to compare the stores.
+// Pass a scale factor as the first argument to change the problem sizes.
+
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(const Clock::time_point &begin, const Clock::time_point &end) {
+    return std::chrono::duration<double>(end - begin).count();
+}
+
+// Number of second-order updates of the sweep, measured on the propagated graph: 
+// every node of a vertex is pushed through each of its outgoing edges, its self edge 
+// to every pair of them, and its second-order weights create an edge each
+size_t CountSoUpdates(const ADGraph &graph) {
+    size_t count = 0;
+    for (VertexId vid = 1; vid < graph.vertices.size(); vid++) {
+        const ADVertex &v = graph.vertices[vid];
+        if (v.e1.to == vid) {
+            continue;
+        }
+        size_t numEdges = 1, numCreated = v.soW != Weight(0.0);
+        if (IsNary(v)) {
+            const ADNaryVertex &nary = graph.naryVertices[NaryIndex(v)];
+            numEdges = nary.edgeEnd - nary.edgeBegin;
+            numCreated = nary.soEnd - nary.soBegin;
+        } else if (v.e2.to != vid) {
+            numEdges = 2;
+        }
+        count += graph.soEdges[vid].nodes.size() * numEdges + numCreated;
+        if (graph.selfSoEdges[vid] != Real(0.0)) {
+            count += numEdges * (numEdges + 1) / 2;
+        }
+    }
+    return count;
+}
+
+// Bytes held by the graph after the propagation
+size_t GraphMemory(const ADGraph &graph) {
+    size_t bytes = graph.vertices.capacity() * sizeof(ADVertex) +
+                   graph.selfSoEdges.capacity() * sizeof(Real) +
+                   graph.soEdges.capacity() * sizeof(SoEdgeStore) +
+                   graph.naryEdges.capacity() * sizeof(ADEdge) +
+                   graph.narySoEdges.capacity() * sizeof(ADSoEdge);
+    // the second-order nodes are allocated from the arena
+    return bytes + graph.arena.Capacity();
+}
+
+// Peak resident memory of the process in MB
+double PeakMemory() {
+#ifndef WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+#else
+    return 0.0;
+#endif
+}
+
+typedef AReal (*Function)(const std::vector<AReal> &x);
+
+AReal Rosenbrock(const std::vector<AReal> &x) {
+    AReal f = AReal(Real(0.0));
+    for (size_t i = 0; i + 1 < x.size(); i += 2) {
+        f += Real(100.0) * square(x[i + 1] - square(x[i])) + square(Real(1.0) - x[i]);
+    }
+    return f;
+}
+
+AReal QuadraticForm(const std::vector<AReal> &x) {
+    AReal f = AReal(Real(0.0));
+    for (size_t i = 0; i < x.size(); i++) {
+        AReal row = AReal(Real(0.0));
+        for (size_t j = 0; j <= i; j++) {
+            row += Real(1.0 + (i * 7 + j * 3) % 5) * x[j];
+        }
+        f += x[i] * row;
+    }
+    return f;
+}
+
+AReal ExpLogSum(const std::vector<AReal> &x) {
+    AReal f = AReal(Real(0.0));
+    for (size_t i = 0; i + 1 < x.size(); i++) {
+        f += exp(x[i] * Real(0.1)) * log(x[i + 1] * x[i + 1] + Real(1.0));
+    }
+    return f;
+}
+
+// Long chains of unary operations, propagated through the single-edge vertices
+AReal Chain(const std::vector<AReal> &x) {
+    AReal f = AReal(Real(0.0));
+    for (size_t i = 0; i < x.size(); i++) {
+        AReal y = x[i];
+        for (int k = 0; k < 1000; k++) {
+            y = asin(sin(y) * Real(0.999));
+        }
+        f += y;
+    }
+    return f;
+}
+
+// Products of pseudo-random pairs of variables
+AReal WideSparse(const std::vector<AReal> &x) {
+    AReal f = AReal(Real(0.0));
+    const size_t n = x.size();
+    for (size_t i = 0; i < n; i++) {
+        f += x[i] * x[(i * 7919 + 13) % n] + cos(x[(i * 104729) % n]);
+    }
+    return f;
+}
+
+void Bench(const char *name, Function func, const int n, const int repeats) {
+    ADGraph adGraph;
+    std::vector<AReal> x(n);
+    double recordTime = 0.0, propagateTime = 0.0, hessianTime = 0.0, gradientTime = 0.0, hvpTime = 0.0;
+    std::vector<Real> v(n, Real(1.0)), hv(n);
+    size_t numVertices = 0, numUpdates = 0, memory = 0, numEntries = 0;
+    for (int r = 0; r < repeats; r++) {
+        adGraph.Clear();
+        Clock::time_point t0 = Clock::now();
+        for (int i = 0; i < n; i++) {
+            x[i] = AReal(Real(0.5) + Real(i % 10) * Real(0.1));
+        }
+        AReal f = func(x);
+        Clock::time_point t1 = Clock::now();
+        SetAdjoint(f, Real(1.0));
+        PropagateAdjoint();
+        Clock::time_point t2 = Clock::now();
+        std::vector<HessianEntry> entries;
+        GetHessianCOO(x, entries);
+        Clock::time_point t3 = Clock::now();
+        SetAdjoint(f, Real(1.0));
+        PropagateAdjointFirstOrder();
+        Clock::time_point t4 = Clock::now();
+        SetAdjoint(f, Real(1.0));
+        PropagateHessianVectorProduct(x, v.data(), hv.data());
+        Clock::time_point t5 = Clock::now();
+
+        recordTime += Seconds(t0, t1);
+        propagateTime += Seconds(t1, t2);
+        hessianTime += Seconds(t2, t3);
+        gradientTime += Seconds(t3, t4);
+        hvpTime += Seconds(t4, t5);
+        numVertices = adGraph.vertices.size();
+        numUpdates = CountSoUpdates(adGraph);
+        memory = std::max(memory, GraphMemory(adGraph));
+        numEntries = entries.size();
+    }
+    recordTime /= repeats;
+    propagateTime /= repeats;
+    hessianTime /= repeats;
+    gradientTime /= repeats;
+    hvpTime /= repeats;
+    printf("%-14s %8d %10zu %12.3e %10zu %12.3e %10.3f %10zu %10.3f %10.3f %10.3f %10.2f\n",
+           name, n, numVertices, numVertices / recordTime, numUpdates, numUpdates / propagateTime,
+           propagateTime * 1e3, numEntries, hessianTime * 1e3, gradientTime * 1e3, hvpTime * 1e3,
+           memory / (1024.0 * 1024.0));
+}
+
+int main(int argc, char *argv[]) {
+    double scale = argc > 1 ? atof(argv[1]) : 1.0;
+    if (scale <= 0.0) {
+        scale = 1.0;
+    }
+#if defined(USE_HASHMAP)
+    const char *store = "hash map";
+#elif defined(USE_AATREE)
+    const char *store = "AA-tree";
+#else
+    const char *store = "binary tree";
+#endif
+    printf("second-order edge store: %s\n", store);
+    printf("%-14s %8s %10s %12s %10s %12s %10s %10s %10s %10s %10s %10s\n",
+           "workload", "n", "vertices", "vertices/s", "so-updates", "updates/s",
+           "sweep(ms)", "entries", "hess(ms)", "grad(ms)", "hvp(ms)", "graph(MB)");
+    Bench("rosenbrock", Rosenbrock, int(100000 * scale), 5);
+    Bench("quadratic", QuadraticForm, int(300 * scale), 5);
+    Bench("explog", ExpLogSum, int(100000 * scale), 5);
+    Bench("chain", Chain, int(500 * scale), 5);
+    Bench("widesparse", WideSparse, int(100000 * scale), 5);
+    printf("peak memory: %.1f MB\n", PeakMemory());
+    return 0;
+}
@@ -32,38 +32,103 @@
     SOFTWARE.
 **/
 
-#ifndef HAD_H__
+// had.h can be included once more per translation unit with a different HAD_NAMESPACE 
+// (see the configuration macros below), the default configuration only once
+#if !defined(HAD_H__) || defined(HAD_NAMESPACE)
+#ifndef HAD_NAMESPACE
 #define HAD_H__
+#endif
 
 #include <vector>
 #include <cmath>
 #ifdef WIN32
 #define threadDefine thread_local
 #else
+#ifndef NO_AATREE
 #define USE_AATREE
+#endif
 #define threadDefine __thread
 #endif
 
 #include <vector>
 #include <cmath>
 #include <algorithm>
+#include <functional>
+#include <utility>
+#ifdef USE_THREADS
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+#if defined(USE_STATS) || defined(USE_TAPE_FILE)
+#include <cstdio>
+#endif
+#ifdef USE_TAPE_FILE
+#include <cstring>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
 
 #ifndef M_PI
 #define M_PI std::acos(-1)
 #endif
 
-namespace had {
+// Define HAD_REAL (default double) to change the type of the values & adjoints, 
+// HAD_WEIGHT (default HAD_REAL) to store the partial derivatives of the edges with another type 
+// (e.g. float weights & double adjoints), and HAD_VERTEX_ID (default unsigned int) to change 
+// the type of the vertex ids (e.g. unsigned long long for graphs of more than 2^31 vertices).
+// Define HAD_NAMESPACE (default had) to put a configuration in another namespace, so that
+// several of them can be used in the same program, e.g.
+//   #include "had.h"
+//   #define HAD_NAMESPACE hadf
+//   #define HAD_REAL float
+//   #include "had.h"
+// The macros are undefined at the end of the header.
+#ifndef HAD_NAMESPACE
+#define HAD_NAMESPACE had
+#endif
+#ifndef HAD_REAL
+#define HAD_REAL double
+#endif
+#ifndef HAD_WEIGHT
+#define HAD_WEIGHT HAD_REAL
+#endif
+#ifndef HAD_VERTEX_ID
+#define HAD_VERTEX_ID unsigned int
+#endif
+
+namespace HAD_NAMESPACE {
+
+typedef HAD_REAL Real; 
+typedef HAD_WEIGHT Weight;
+typedef HAD_VERTEX_ID VertexId;
+// Define USE_HASHMAP to store the second-order edges in open-addressing hash maps
+// instead of binary trees (see SoEdgeStore below)
+// Define USE_THREADS to enable the multithreaded functions (requires <thread>)
+// Define NO_AATREE to use plain (unbalanced) binary trees instead of AA-trees
+// Define USE_STATS to count the work of every sweep in ADGraph::stats
+// Define USE_TAPE_FILE to enable SaveTape() & ADMappedTape (requires mmap on non-Windows platforms)
 
-// Change the following line if you want to use single precision floats
-typedef double Real; 
-typedef unsigned int VertexId;
+#ifdef USE_STATS
+#define HAD_STATS(statement) statement
+#else
+#define HAD_STATS(statement)
+#endif
 
 struct ADGraph;
 struct AReal;
+template <typename E> struct AExpr;
 
 extern threadDefine ADGraph* g_ADGraph;
-// Declare this in your .cpp source
-#define DECLARE_ADGRAPH() namespace had { threadDefine ADGraph* g_ADGraph = 0; }
+// Declare this in your .cpp source, 
+// and DECLARE_ADGRAPH_IN(ns) for the configurations of another HAD_NAMESPACE ns
+#define DECLARE_ADGRAPH_IN(ns) namespace ns { threadDefine ADGraph* g_ADGraph = 0; }
+#define DECLARE_ADGRAPH() DECLARE_ADGRAPH_IN(had)
 
 AReal NewAReal(const Real val);
 
@@ -77,6 +142,12 @@ struct AReal {
     AReal(const Real val, const VertexId varId) : 
         val(val), varId(varId) {}
 
+    // Fold an expression template into a single vertex (see Expr())
+    template <typename E>
+    AReal(const AExpr<E> &expr);
+    template <typename E>
+    AReal& operator=(const AExpr<E> &expr);
+
     Real val;
     VertexId varId;
 };
@@ -84,14 +155,17 @@ struct AReal {
 struct ADEdge {
     ADEdge() {}
     ADEdge(const VertexId to, const Real w = Real(0.0)) : 
-        to(to), w(w) {}
+        to(to), w(Weight(w)) {}
 
     VertexId to;
-    Real w;
+    Weight w;
 };
 
-// We assume there is at most 2 outgoing edges from this vertex
+// We assume there is at most 2 outgoing edges from this vertex, 
+// except for the n-ary vertices (see ADNaryVertex)
 struct ADVertex {
+    // Uninitialized, for the vertices that are appended in bulk (see UnaryOp over arrays)
+    ADVertex() {}
     ADVertex(const VertexId newId) {
         e1 = e2 = ADEdge(newId);
         w = soW = Real(0.0);
@@ -107,12 +181,283 @@ struct ADVertex {
     // for vertex with two outgoing edges,
     // soW represents the second-order weight between the conntecting vertices (d^2f/dxdy)
     // the system assumes d^2f/dx^2 & d^2f/dy^2 are both zero in the two outgoing edges case to save memory
-    Real soW;
+    Weight soW;
+};
+
+// Second-order weight d^2f/dxdy of a n-ary vertex, 
+// to1 == to2 for the second-order weight d^2f/dx^2 of a single parent
+struct ADSoEdge {
+    ADSoEdge() {}
+    ADSoEdge(const VertexId to1, const VertexId to2, const Real w) : 
+        to1(to1), to2(to2), w(Weight(w)) {}
+
+    VertexId to1, to2;
+    Weight w;
+};
+
+// A vertex with any number of outgoing edges and a block of second-order weights among 
+// the connecting vertices, stored in ADGraph::naryEdges & ADGraph::narySoEdges.
+// For such a vertex, e1.to == e2.to == (kNaryFlag | index in ADGraph::naryVertices), 
+// which takes the top bit of VertexId and limits the number of vertices of a graph 
+// to half its range (2^31 with the default unsigned int)
+struct ADNaryVertex {
+    ADNaryVertex() {}
+    ADNaryVertex(const VertexId edgeBegin, const VertexId edgeEnd,
+                 const VertexId soBegin, const VertexId soEnd) :
+        edgeBegin(edgeBegin), edgeEnd(edgeEnd), soBegin(soBegin), soEnd(soEnd) {}
+
+    // offsets in ADGraph::naryEdges & ADGraph::narySoEdges, as wide as the vertex ids 
+    // since a graph with more vertices than 32 bits can count has as many n-ary edges
+    VertexId edgeBegin, edgeEnd;
+    VertexId soBegin, soEnd;
+};
+
+const VertexId kNaryFlag = VertexId(1) << (sizeof(VertexId) * 8 - 1);
+
+inline bool IsNary(const ADVertex &v) {
+    return (v.e1.to & kNaryFlag) != 0;
+}
+
+inline VertexId NaryIndex(const ADVertex &v) {
+    return v.e1.to & ~kNaryFlag;
+}
+
+// Chunked bump allocator for the second-order edges of a graph (see ADGraph::arena).
+// The blocks are rounded up to powers of two, a freed block goes to the free list of its size 
+// and is handed out again before anything new is carved from the chunks.
+// The blocks too large for a size class come from the heap, a freed one is kept by the arena 
+// and handed out again for a request of at most its size.
+// Reset() drops every block at once and keeps the chunks & the large blocks for the next sweep.
+struct ADArena {
+    ADArena() {
+        Reset();
+    }
+
+    ~ADArena() {
+        for (size_t i = 0; i < largeBlocks.size(); i++) {
+            ::operator delete(largeBlocks[i].data);
+        }
+        for (size_t i = 0; i < chunks.size(); i++) {
+            ::operator delete(chunks[i].data);
+        }
+    }
+
+    inline void *Allocate(size_t bytes) {
+        const int c = SizeClass(bytes);
+        if (c >= kNumClasses) {
+            return AllocateLarge(bytes);
+        }
+        if (freeLists[c] != 0) {
+            FreeBlock *block = freeLists[c];
+            freeLists[c] = block->next;
+            return block;
+        }
+        bytes = size_t(kMinBlock) << c;
+        while (chunk < chunks.size() && offset + bytes > chunks[chunk].size) {
+            chunk++;
+            offset = 0;
+        }
+        if (chunk == chunks.size()) {
+            // chunks double in size up to kMaxChunk, and hold at least the block
+            const size_t size = std::max(bytes, chunks.empty() ? (size_t)kMinChunk : 
+                std::min(chunks.back().size * 2, (size_t)kMaxChunk));
+            chunks.push_back(Chunk((char*)::operator new(size), size));
+            offset = 0;
+        }
+        void *p = chunks[chunk].data + offset;
+        offset += bytes;
+        return p;
+    }
+
+    inline void Deallocate(void *p, const size_t bytes) {
+        const int c = SizeClass(bytes);
+        if (c >= kNumClasses) {
+            // the large blocks are released even while dropping, they are not part of the chunks
+            for (size_t i = 0; i < largeBlocks.size(); i++) {
+                if (largeBlocks[i].data == (char*)p) {
+                    largeBlocks[i].used = false;
+                    break;
+                }
+            }
+            return;
+        }
+        if (dropping) {
+            return;
+        }
+        FreeBlock *block = (FreeBlock*)p;
+        block->next = freeLists[c];
+        freeLists[c] = block;
+    }
+
+    // Between Drop() & Reset() the deallocations are ignored, 
+    // so that the owners can let go of their blocks without touching them
+    inline void Drop() {
+        dropping = true;
+    }
+
+    // Forget every block, the owners of the blocks must not use them anymore
+    inline void Reset() {
+        chunk = 0;
+        offset = 0;
+        dropping = false;
+        std::fill(freeLists, freeLists + kNumClasses, (FreeBlock*)0);
+        for (size_t i = 0; i < largeBlocks.size(); i++) {
+            largeBlocks[i].used = false;
+        }
+    }
+
+    // Bytes of the chunks & of the large blocks
+    inline size_t Capacity() const {
+        size_t bytes = ChunkCapacity();
+        for (size_t i = 0; i < largeBlocks.size(); i++) {
+            bytes += largeBlocks[i].size;
+        }
+        return bytes;
+    }
+
+    // Bytes of the chunks handed out since the last Reset()
+    inline size_t Used() const {
+        size_t bytes = offset;
+        for (size_t i = 0; i < chunk && i < chunks.size(); i++) {
+            bytes += chunks[i].size;
+        }
+        return bytes;
+    }
+
+    // Sizes of the large blocks held by the arena, in decreasing order
+    inline std::vector<size_t> LargeBlockSizes() const {
+        std::vector<size_t> sizes;
+        for (size_t i = 0; i < largeBlocks.size(); i++) {
+            sizes.push_back(largeBlocks[i].size);
+        }
+        std::sort(sizes.begin(), sizes.end(), std::greater<size_t>());
+        return sizes;
+    }
+
+    // Allocate the chunks of at least bytes bytes in all, with the same sizes as on demand, 
+    // and the large blocks missing for largeSizes (in decreasing order)
+    inline void Reserve(const size_t bytes, 
+                        const std::vector<size_t> &largeSizes = std::vector<size_t>()) {
+        size_t capacity = ChunkCapacity();
+        while (capacity < bytes) {
+            const size_t size = chunks.empty() ? (size_t)kMinChunk : 
+                std::min(chunks.back().size * 2, (size_t)kMaxChunk);
+            chunks.push_back(Chunk((char*)::operator new(size), size));
+            capacity += size;
+        }
+        const std::vector<size_t> sizes = LargeBlockSizes();
+        for (size_t i = 0, j = 0; i < largeSizes.size(); i++) {
+            if (j < sizes.size() && sizes[j] >= largeSizes[i]) {
+                j++;
+            } else {
+                largeBlocks.push_back(LargeBlock((char*)::operator new(largeSizes[i]), largeSizes[i]));
+            }
+        }
+    }
+
+    ADArena(const ADArena&) = delete;
+    ADArena& operator=(const ADArena&) = delete;
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+    struct Chunk {
+        Chunk(char *data, const size_t size) : data(data), size(size) {}
+        char *data;
+        size_t size;
+    };
+    struct LargeBlock {
+        LargeBlock(char *data, const size_t size) : data(data), size(size), used(false) {}
+        char *data;
+        size_t size;
+        bool used;
+    };
+
+    inline size_t ChunkCapacity() const {
+        size_t bytes = 0;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            bytes += chunks[i].size;
+        }
+        return bytes;
+    }
+
+    // the smallest free large block of at least bytes bytes, or a new one
+    inline void *AllocateLarge(const size_t bytes) {
+        LargeBlock *best = 0;
+        for (size_t i = 0; i < largeBlocks.size(); i++) {
+            LargeBlock &block = largeBlocks[i];
+            if (!block.used && block.size >= bytes && (best == 0 || block.size < best->size)) {
+                best = &block;
+            }
+        }
+        if (best == 0) {
+            largeBlocks.push_back(LargeBlock((char*)::operator new(bytes), bytes));
+            best = &largeBlocks.back();
+        }
+        best->used = true;
+        return best->data;
+    }
+
+    // blocks of kMinBlock << c bytes, the larger ones are allocated on the heap
+    enum { kMinBlock = 16, kNumClasses = 17, kMinChunk = 1 << 16, kMaxChunk = 1 << 24 };
+
+    static inline int SizeClass(const size_t bytes) {
+        int c = 0;
+        while ((size_t(kMinBlock) << c) < bytes) {
+            c++;
+        }
+        return c;
+    }
+
+    std::vector<Chunk> chunks;
+    std::vector<LargeBlock> largeBlocks;
+    size_t chunk, offset;
+    bool dropping;
+    FreeBlock *freeLists[kNumClasses];
+};
+
+// STL allocator drawing from an ADArena, or from the heap if arena is null
+template <typename T>
+struct ADArenaAllocator {
+    typedef T value_type;
+
+    ADArenaAllocator(ADArena *arena = 0) : arena(arena) {}
+    template <typename U>
+    ADArenaAllocator(const ADArenaAllocator<U> &other) : arena(other.arena) {}
+
+    inline T *allocate(const size_t n) {
+        if (arena == 0) {
+            return (T*)::operator new(n * sizeof(T));
+        }
+        return (T*)arena->Allocate(n * sizeof(T));
+    }
+
+    inline void deallocate(T *p, const size_t n) {
+        if (arena == 0) {
+            ::operator delete(p);
+        } else {
+            arena->Deallocate(p, n * sizeof(T));
+        }
+    }
+
+    ADArena *arena;
 };
 
-struct BTNode {
-    BTNode() {}
-    BTNode(const VertexId key, const Real val) : key(key), val(val) {
+template <typename T, typename U>
+inline bool operator==(const ADArenaAllocator<T> &a, const ADArenaAllocator<U> &b) {
+    return a.arena == b.arena;
+}
+template <typename T, typename U>
+inline bool operator!=(const ADArenaAllocator<T> &a, const ADArenaAllocator<U> &b) {
+    return a.arena != b.arena;
+}
+
+// The stores of the second-order edges are templated on the type of the weights, 
+// which is Real except for the vector-mode adjoints (see VectorAdjoint)
+template <typename T>
+struct BTNodeT {
+    BTNodeT() {}
+    BTNodeT(const VertexId key, const T &val) : key(key), val(val) {
         left = right = - 1;
 #ifdef USE_AATREE
         level = 1;
@@ -120,7 +465,7 @@ struct BTNode {
     }
 
     VertexId key;
-    Real val;
+    T val;
     int left;
     int right;
 #ifdef USE_AATREE
@@ -128,18 +473,23 @@ struct BTNode {
 #endif
 };
 
-struct BTree {
-    BTree() {
-        nodes.reserve(32);
+template <typename T>
+struct BTreeT {
+    typedef BTNodeT<T> Node;
+    typedef std::vector<Node, ADArenaAllocator<Node> > Nodes;
+
+    // Storage is only allocated when the first edge is inserted, 
+    // most of the vertices never receive any second-order edge
+    BTreeT(ADArena *arena = 0) : nodes(ADArenaAllocator<Node>(arena)) {
         root = 0;
     }
 #ifdef USE_AATREE
     inline void Skew() {
-        if (nodes.size() == 0 ||
-            nodes[root].left == -1) {
+        if (nodes.size() == 0) {
             return;
         }
-        while (nodes[nodes[root].left].level == nodes[root].level) {
+        while (nodes[root].left != -1 &&
+               nodes[nodes[root].left].level == nodes[root].level) {
             int l = nodes[root].left;
             nodes[root].left = nodes[l].right;
             nodes[l].right = root;
@@ -148,12 +498,12 @@ struct BTree {
     }
 
     inline void Split() {
-        if (nodes.size() == 0 ||
-            nodes[root].right == -1 ||
-            nodes[nodes[root].right].right == -1) {
+        if (nodes.size() == 0) {
             return;
         }
-        while (nodes[root].level == nodes[nodes[nodes[root].right].right].level) {
+        while (nodes[root].right != -1 &&
+               nodes[nodes[root].right].right != -1 &&
+               nodes[root].level == nodes[nodes[nodes[root].right].right].level) {
             int r = nodes[root].right;
             nodes[root].right = nodes[r].left;
             nodes[r].left = root;
@@ -162,29 +512,33 @@ struct BTree {
         }
     }
 #endif
-    inline void Insert(const VertexId key, const Real val) {
+    // Returns true if a new node is created
+    inline bool Insert(const VertexId key, const T &val) {
         int index = root;
         if (nodes.size() > 0) {
             int *lastEdge;
             do {
                 if (key == nodes[index].key) {
                     nodes[index].val += val;
-                    return;
+                    return false;
                 }
                 lastEdge = &(nodes[index].left) + (key > nodes[index].key);
                 index = *lastEdge;
             } while (index >= 0);
 
             *lastEdge = nodes.size();
+        } else {
+            nodes.reserve(8);
         }
-        nodes.push_back(BTNode(key, val));
+        nodes.push_back(Node(key, val));
 #ifdef USE_AATREE
         Skew();
         Split();
 #endif
+        return true;
     }
 
-    inline Real Query(const VertexId key) {
+    inline T Query(const VertexId key) const {
         int index = root;
         while (index >= 0 && index < (int)nodes.size()) {
             if (key == nodes[index].key) {
@@ -195,7 +549,7 @@ struct BTree {
                 index = nodes[index].right;
             }
         }
-        return Real(0.0);
+        return T();
     }
 
     inline void Clear() {
@@ -203,59 +557,644 @@ struct BTree {
         root = 0;
     }
 
-    std::vector<BTNode> nodes;
+    // Clear and give the memory back to the system
+    inline void Release() {
+        Nodes(nodes.get_allocator()).swap(nodes);
+        root = 0;
+    }
+
+    Nodes nodes;
     int root;
 };
+typedef BTNodeT<Real> BTNode;
+typedef BTreeT<Real> BTree;
+
+template <typename T>
+struct HashNodeT {
+    HashNodeT() {}
+    HashNodeT(const VertexId key, const T &val) : key(key), val(val) {}
+
+    VertexId key;
+    T val;
+};
+
+// Open-addressing (linear probing) hash map with the same interface as BTree.
+// The nodes are kept densely in insertion order so that they can be iterated 
+// like the BTree nodes, the slots only store indices into the nodes.
+template <typename T>
+struct HashMapT {
+    typedef HashNodeT<T> Node;
+    typedef std::vector<Node, ADArenaAllocator<Node> > Nodes;
+    typedef std::vector<int, ADArenaAllocator<int> > Slots;
+
+    HashMapT(ADArena *arena = 0) : 
+        nodes(ADArenaAllocator<Node>(arena)), slots(ADArenaAllocator<int>(arena)) {
+        mask = 0;
+    }
+
+    inline int Slot(const VertexId key) const {
+        unsigned int h = (unsigned int)key * 2654435761u;
+        return (int)((h ^ (h >> 16)) & mask);
+    }
+
+    inline void Rehash(const size_t size) {
+        slots.assign(size, -1);
+        mask = (unsigned int)size - 1;
+        for (int i = 0; i < (int)nodes.size(); i++) {
+            int s = Slot(nodes[i].key);
+            while (slots[s] >= 0) {
+                s = (s + 1) & mask;
+            }
+            slots[s] = i;
+        }
+    }
+
+    // Returns true if a new node is created
+    inline bool Insert(const VertexId key, const T &val) {
+        if (slots.size() == 0) {
+            nodes.reserve(4);
+            Rehash(8);
+        }
+        int s = Slot(key);
+        while (slots[s] >= 0) {
+            if (nodes[slots[s]].key == key) {
+                nodes[slots[s]].val += val;
+                return false;
+            }
+            s = (s + 1) & mask;
+        }
+        slots[s] = nodes.size();
+        nodes.push_back(Node(key, val));
+        // keep the load factor below 1/2
+        if (nodes.size() * 2 > slots.size()) {
+            Rehash(slots.size() * 2);
+        }
+        return true;
+    }
+
+    inline T Query(const VertexId key) const {
+        if (slots.size() == 0) {
+            return T();
+        }
+        int s = Slot(key);
+        while (slots[s] >= 0) {
+            if (nodes[slots[s]].key == key) {
+                return nodes[slots[s]].val;
+            }
+            s = (s + 1) & mask;
+        }
+        return T();
+    }
+
+    inline void Clear() {
+        if (nodes.size() > 0) {
+            nodes.clear();
+            std::fill(slots.begin(), slots.end(), -1);
+        }
+    }
+
+    // Clear and give the memory back to the system
+    inline void Release() {
+        Nodes(nodes.get_allocator()).swap(nodes);
+        Slots(slots.get_allocator()).swap(slots);
+        mask = 0;
+    }
+
+    Nodes nodes;
+    Slots slots;
+    unsigned int mask;
+};
+typedef HashNodeT<Real> HashNode;
+typedef HashMapT<Real> HashMap;
+
+// Second-order edges of a vertex v: the keys are the vertex ids u < v 
+// and the values are the weights of the edges (v, u)
+#ifdef USE_HASHMAP
+template <typename T> using SoEdgeStoreT = HashMapT<T>;
+#else
+template <typename T> using SoEdgeStoreT = BTreeT<T>;
+#endif
+typedef SoEdgeStoreT<Real> SoEdgeStore;
+
+// Operation codes, only recorded if ADGraph::recordOps is true (see Replay())
+enum ADOpCode {
+    OP_INPUT,
+    // a leaf created after the first operation (e.g. AReal f = 0.0), kept by Replay()
+    OP_CONST,
+    // binary operations
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    // unary operations, c is the constant operand
+    OP_ADD_CONST,
+    OP_CONST_SUB,
+    OP_MUL_CONST,
+    OP_INV,
+    OP_SQUARE,
+    OP_SQRT,
+    OP_POW,
+    OP_EXP,
+    OP_LOG,
+    OP_SIN,
+    OP_COS,
+    OP_TAN,
+    OP_ASIN,
+    OP_ACOS,
+    // n-ary vertex, cannot be replayed
+    OP_NARY
+};
+
+struct ADOp {
+    ADOp() {}
+    ADOp(const ADOpCode code, const Real val) :
+        code(code), a(0), b(0), c(Real(0.0)), val(val) {}
+
+    ADOpCode code;
+    // operands
+    VertexId a, b;
+    Real c;
+    // value of the vertex at the last recording or replay
+    Real val;
+};
+
+enum ADCmpCode {
+    CMP_LT,
+    CMP_LE,
+    CMP_GT,
+    CMP_GE,
+    CMP_EQ
+};
+
+// The result of a comparison evaluated while recording, 
+// a replay is only valid if all the comparisons give the same results
+struct ADGuard {
+    ADGuard() {}
+    ADGuard(const ADCmpCode code, const VertexId l, const VertexId r, const bool result) :
+        code(code), l(l), r(r), result(result) {}
+
+    ADCmpCode code;
+    VertexId l, r;
+    bool result;
+};
+
+#ifdef USE_STATS
+// Counters of the last reverse sweep
+struct ADStats {
+    ADStats() {
+        Reset();
+    }
+
+    inline void Reset() {
+        verticesVisited = leavesSkipped = 0;
+        pushEdgeCalls = insertHits = insertNodes = 0;
+        maxSoEdgeNodes = totalSoEdgeNodes = selfSoEdgeNonzeros = 0;
+    }
+
+    // Account for the second-order edges of a vertex once they are complete
+    template <typename Store>
+    inline void AddVertex(const Store &store, const bool nonzero) {
+        maxSoEdgeNodes = std::max(maxSoEdgeNodes, (size_t)store.nodes.size());
+        totalSoEdgeNodes += store.nodes.size();
+        selfSoEdgeNonzeros += nonzero;
+    }
+
+    inline void Print(FILE *file = stdout) const {
+        fprintf(file, "vertices visited:      %zu\n", verticesVisited);
+        fprintf(file, "leaves skipped:        %zu\n", leavesSkipped);
+        fprintf(file, "PushEdge calls:        %zu\n", pushEdgeCalls);
+        fprintf(file, "Insert hits:           %zu\n", insertHits);
+        fprintf(file, "Insert new nodes:      %zu\n", insertNodes);
+        fprintf(file, "max soEdges nodes:     %zu\n", maxSoEdgeNodes);
+        fprintf(file, "total soEdges nodes:   %zu\n", totalSoEdgeNodes);
+        fprintf(file, "selfSoEdges nonzeros:  %zu\n", selfSoEdgeNonzeros);
+    }
+
+    // non-leaf vertices processed by the sweep
+    size_t verticesVisited;
+    // leaf vertices (e1.to == vid) skipped by the sweep
+    size_t leavesSkipped;
+    // second-order edges pushed through a first-order edge
+    size_t pushEdgeCalls;
+    // insertions into an existing node / creating a new node of the soEdges stores
+    size_t insertHits, insertNodes;
+    // number of nodes of the largest soEdges store and of all of them, 
+    // counted when the edges of each vertex are complete (before they are released in streaming mode)
+    size_t maxSoEdgeNodes, totalSoEdgeNodes;
+    // nonzero selfSoEdges
+    size_t selfSoEdgeNonzeros;
+};
+#endif
 
 struct ADGraph {
-    ADGraph() {
+    ADGraph(const bool recordOps = false) : recordOps(recordOps) {
+        g_ADGraph = this;
+        streaming = false;
+        fuseUnary = false;
+        soEdgesTracked = false;
+    }
+
+    ~ADGraph() {
+        if (g_ADGraph == this) {
+            g_ADGraph = 0;
+        }
+    }
+
+    // Make this graph the current graph (g_ADGraph) of the calling thread
+    inline void Activate() {
         g_ADGraph = this;
     }
 
+    // Reserve the memory of a recording of numVertices vertices and of the propagation of 
+    // about numSoEdges second-order edges, so that neither of them reallocates 
+    // (except for the second-order edges of a vertex beyond the largest block of the arena)
+    inline void Reserve(const size_t numVertices, const size_t numSoEdges = 0) {
+        vertices.reserve(numVertices);
+        selfSoEdges.reserve(numVertices);
+        touchedSoEdges.reserve(numVertices);
+        if (soEdges.size() < numVertices) {
+            soEdges.resize(numVertices, SoEdgeStore(&arena));
+        }
+        if (recordOps) {
+            ops.reserve(numVertices);
+        }
+        // the nodes of a vertex are in a block of up to twice their size
+        arena.Reserve(numSoEdges * 2 * sizeof(SoEdgeStore::Nodes::value_type));
+    }
+
+    // The memory is kept for the next recording, including the storage of the 
+    // second-order edges, which is cleared at the beginning of PropagateAdjoint()
     inline void Clear() {
         vertices.clear();
-        soEdges.clear();
         selfSoEdges.clear();
+        ops.clear();
+        guards.clear();
+        naryVertices.clear();
+        naryEdges.clear();
+        narySoEdges.clear();
     }
 
     std::vector<ADVertex> vertices;
-    std::vector<BTree> soEdges;
+    // Storage of the nodes of soEdges, declared first so that it outlives them
+    ADArena arena;
+    std::vector<SoEdgeStore> soEdges;
     std::vector<Real> selfSoEdges;
+    // The vertices whose soEdges or selfSoEdges may be nonzero after the last PropagateAdjoint(), 
+    // so that the next one only resets those (all of them if soEdgesTracked is false)
+    std::vector<VertexId> touchedSoEdges;
+    bool soEdgesTracked;
+    // If true, PropagateAdjoint() releases the second-order edges of every 
+    // non-leaf vertex right after pushing them, so the peak memory 
+    // is bounded by the edges that are still alive. 
+    // The second-order adjoints are then only available for the leaf vertices.
+    bool streaming;
+    // If true, an unary operation applied to a temporary AReal whose vertex is the last one 
+    // and has a single edge, e.g. exp(sin(x * 2.0)), updates that vertex instead of adding one.
+    // The temporary must not be a copy of an AReal that is used afterwards.
+    // Ignored if recordOps is true.
+    bool fuseUnary;
+    // If true, the operation of each vertex is recorded in ops 
+    // and the comparisons in guards, so that the graph can be replayed at new inputs
+    bool recordOps;
+    std::vector<ADOp> ops;
+    std::vector<ADGuard> guards;
+    std::vector<ADNaryVertex> naryVertices;
+    std::vector<ADEdge> naryEdges;
+    std::vector<ADSoEdge> narySoEdges;
+#ifdef USE_STATS
+    ADStats stats;
+#endif
 };
 
-inline AReal NewAReal(const Real val) {
-    std::vector<ADVertex> &vertices = g_ADGraph->vertices;
+// Make graph the current graph of the calling thread until the end of the scope and restore 
+// the previous one, to record several graphs from the same thread or to propagate 
+// a graph in another thread than the one that recorded it
+struct ADGraphScope {
+    ADGraphScope(ADGraph &graph) : previous(g_ADGraph) {
+        g_ADGraph = &graph;
+    }
+    ~ADGraphScope() {
+        g_ADGraph = previous;
+    }
+    ADGraphScope(const ADGraphScope&) = delete;
+    ADGraphScope& operator=(const ADGraphScope&) = delete;
+
+    ADGraph *previous;
+};
+
+// High-water marks of the graphs of earlier runs of the same objective, 
+// to reserve all the memory of the next recording and propagation up front:
+//   estimator.Reserve(graph);
+//   ... record & propagate ...
+//   estimator.Update(graph);
+struct ADGraphEstimator {
+    ADGraphEstimator() : numVertices(0), arenaBytes(0), numOps(0), numGuards(0), 
+                         numNaryVertices(0), numNaryEdges(0), numNarySoEdges(0) {}
+
+    // Raise the marks to the sizes of graph, after its propagation
+    inline void Update(const ADGraph &graph) {
+        numVertices = std::max(numVertices, graph.vertices.size());
+        arenaBytes = std::max(arenaBytes, graph.arena.Used());
+        // the i-th largest block of the stores beyond the size classes of the arena
+        const std::vector<size_t> sizes = graph.arena.LargeBlockSizes();
+        largeBlocks.resize(std::max(largeBlocks.size(), sizes.size()), 0);
+        for (size_t i = 0; i < sizes.size(); i++) {
+            largeBlocks[i] = std::max(largeBlocks[i], sizes[i]);
+        }
+        numOps = std::max(numOps, graph.ops.size());
+        numGuards = std::max(numGuards, graph.guards.size());
+        numNaryVertices = std::max(numNaryVertices, graph.naryVertices.size());
+        numNaryEdges = std::max(numNaryEdges, graph.naryEdges.size());
+        numNarySoEdges = std::max(numNarySoEdges, graph.narySoEdges.size());
+    }
+
+    // Reserve the marks plus margin (e.g. 0.1 for 10% more) on graph, before its recording
+    inline void Reserve(ADGraph &graph, const double margin = 0.0) const {
+        const double f = 1.0 + margin;
+        graph.Reserve(size_t(numVertices * f));
+        std::vector<size_t> sizes(largeBlocks.size());
+        for (size_t i = 0; i < sizes.size(); i++) {
+            sizes[i] = size_t(largeBlocks[i] * f);
+        }
+        graph.arena.Reserve(size_t(arenaBytes * f), sizes);
+        graph.ops.reserve(size_t(numOps * f));
+        graph.guards.reserve(size_t(numGuards * f));
+        graph.naryVertices.reserve(size_t(numNaryVertices * f));
+        graph.naryEdges.reserve(size_t(numNaryEdges * f));
+        graph.narySoEdges.reserve(size_t(numNarySoEdges * f));
+    }
+
+    size_t numVertices, arenaBytes, numOps, numGuards;
+    size_t numNaryVertices, numNaryEdges, numNarySoEdges;
+    std::vector<size_t> largeBlocks;
+};
+
+// The operations take the graph they record into, the ones without a graph record into g_ADGraph
+inline AReal NewAReal(ADGraph &graph, const Real val) {
+    std::vector<ADVertex> &vertices = graph.vertices;
     VertexId newId = vertices.size();
     vertices.push_back(ADVertex(newId));
+    if (graph.recordOps) {
+        // the independent variables are declared before any computation
+        std::vector<ADOp> &ops = graph.ops;
+        const bool input = ops.empty() || ops.back().code == OP_INPUT;
+        ops.push_back(ADOp(input ? OP_INPUT : OP_CONST, val));
+    }
     return AReal(val, newId);
 }
+inline AReal NewAReal(const Real val) {
+    return NewAReal(*g_ADGraph, val);
+}
 
-inline void AddEdge(const AReal &c, const AReal &p, 
+inline void AddEdge(ADGraph &graph, const AReal &c, const AReal &p, 
                     const Real w, const Real soW) {
-    ADVertex &v = g_ADGraph->vertices[c.varId];
+    ADVertex &v = graph.vertices[c.varId];
     v.e1 = ADEdge(p.varId, w);
     v.soW = soW;
 }
-inline void AddEdge(const AReal &c, 
+inline void AddEdge(const AReal &c, const AReal &p, 
+                    const Real w, const Real soW) {
+    AddEdge(*g_ADGraph, c, p, w, soW);
+}
+inline void AddEdge(ADGraph &graph, const AReal &c, 
                     const AReal &p1, const AReal &p2, 
                     const Real w1, const Real w2,
                     const Real soW) {
-    ADVertex &v = g_ADGraph->vertices[c.varId];
+    ADVertex &v = graph.vertices[c.varId];
     v.e1 = ADEdge(p1.varId, w1);
     v.e2 = ADEdge(p2.varId, w2);
     v.soW = soW;
 }
+inline void AddEdge(const AReal &c, 
+                    const AReal &p1, const AReal &p2, 
+                    const Real w1, const Real w2,
+                    const Real soW) {
+    AddEdge(*g_ADGraph, c, p1, p2, w1, w2, soW);
+}
+
+// Make c a n-ary vertex whose edges are the ones appended to ADGraph::naryEdges & narySoEdges 
+// since edgeBegin & soBegin
+inline void SetNaryVertex(const AReal &c, const VertexId edgeBegin, const VertexId soBegin) {
+    ADGraph &graph = *g_ADGraph;
+    ADVertex &v = graph.vertices[c.varId];
+    v.e1.to = v.e2.to = kNaryFlag | (VertexId)graph.naryVertices.size();
+    graph.naryVertices.push_back(ADNaryVertex(edgeBegin, graph.naryEdges.size(),
+                                              soBegin, graph.narySoEdges.size()));
+    if (graph.recordOps) {
+        graph.ops[c.varId].code = OP_NARY;
+    }
+}
+
+// Make c a n-ary vertex with the first-order edges edges and the second-order weights soEdges,
+// the second-order weight between two different parents is only given once
+inline void AddNaryEdges(const AReal &c, 
+                         const ADEdge *edges, const int numEdges,
+                         const ADSoEdge *soEdges, const int numSoEdges) {
+    ADGraph &graph = *g_ADGraph;
+    const VertexId edgeBegin = graph.naryEdges.size(), soBegin = graph.narySoEdges.size();
+    graph.naryEdges.insert(graph.naryEdges.end(), edges, edges + numEdges);
+    graph.narySoEdges.insert(graph.narySoEdges.end(), soEdges, soEdges + numSoEdges);
+    SetNaryVertex(c, edgeBegin, soBegin);
+}
+
+inline void RecordOp(ADGraph &graph, const AReal &ret, const ADOpCode code, 
+                     const VertexId a, const VertexId b, const Real c) {
+    if (graph.recordOps) {
+        ADOp &op = graph.ops[ret.varId];
+        op.code = code;
+        op.a = a;
+        op.b = b;
+        op.c = c;
+    }
+}
+inline void RecordOp(const AReal &ret, const ADOpCode code, 
+                     const VertexId a, const VertexId b, const Real c) {
+    RecordOp(*g_ADGraph, ret, code, a, b, c);
+}
+
+// Value f, first derivative df and second derivative ddf of an unary operation at x
+inline void EvalUnary(const ADOpCode code, const Real x, const Real c,
+                      Real &f, Real &df, Real &ddf) {
+    switch (code) {
+        case OP_ADD_CONST: {
+            f = x + c;
+            df = Real(1.0);
+            ddf = Real(0.0);
+            break;
+        }
+        case OP_CONST_SUB: {
+            f = c - x;
+            df = Real(-1.0);
+            ddf = Real(0.0);
+            break;
+        }
+        case OP_MUL_CONST: {
+            f = x * c;
+            df = c;
+            ddf = Real(0.0);
+            break;
+        }
+        case OP_INV: {
+            Real invX = Real(1.0) / x;
+            Real invXSq = invX * invX;
+            Real invXCu = invXSq * invX;
+            f = invX;
+            df = -invXSq;
+            ddf = Real(2.0) * invXCu;
+            break;
+        }
+        case OP_SQUARE: {
+            f = x * x;
+            df = Real(2.0) * x;
+            ddf = Real(2.0);
+            break;
+        }
+        case OP_SQRT: {
+            Real sqrtX = std::sqrt(x);
+            Real invSqrtX = Real(1.0) / sqrtX;
+            f = sqrtX;
+            df = Real(0.5) * invSqrtX;
+            ddf = - Real(0.25) * invSqrtX / x;
+            break;
+        }
+        case OP_POW: {
+            f = std::pow(x, c);
+            df = c * std::pow(x, c - Real(1.0));
+            ddf = c * (c - Real(1.0)) * std::pow(x, c - Real(2.0));
+            break;
+        }
+        case OP_EXP: {
+            f = df = ddf = std::exp(x);
+            break;
+        }
+        case OP_LOG: {
+            Real invX = Real(1.0) / x;
+            f = std::log(x);
+            df = invX;
+            ddf = - invX * invX;
+            break;
+        }
+        case OP_SIN: {
+            f = std::sin(x);
+            df = std::cos(x);
+            ddf = -f;
+            break;
+        }
+        case OP_COS: {
+            f = std::cos(x);
+            df = -std::sin(x);
+            ddf = -f;
+            break;
+        }
+        case OP_TAN: {
+            Real secX = Real(1.0) / std::cos(x);
+            Real sec2X = secX * secX;
+            f = std::tan(x);
+            df = sec2X;
+            ddf = Real(2.0) * f * sec2X;
+            break;
+        }
+        case OP_ASIN: {
+            Real tmp = Real(1.0) / (Real(1.0) - x * x);
+            Real sqrtTmp = std::sqrt(tmp);
+            f = std::asin(x);
+            df = sqrtTmp;
+            ddf = x * sqrtTmp * tmp;
+            break;
+        }
+        case OP_ACOS: {
+            Real tmp = Real(1.0) / (Real(1.0) - x * x);
+            Real negSqrtTmp = -std::sqrt(tmp);
+            f = std::acos(x);
+            df = negSqrtTmp;
+            ddf = x * negSqrtTmp * tmp;
+            break;
+        }
+        default: {
+            f = x;
+            df = Real(1.0);
+            ddf = Real(0.0);
+            break;
+        }
+    }
+}
+
+// Value f, first derivatives dfx, dfy and second derivative ddf (d^2f/dxdy) 
+// of a binary operation at (x, y)
+inline void EvalBinary(const ADOpCode code, const Real x, const Real y,
+                       Real &f, Real &dfx, Real &dfy, Real &ddf) {
+    switch (code) {
+        case OP_ADD: {
+            f = x + y;
+            dfx = dfy = Real(1.0);
+            ddf = Real(0.0);
+            break;
+        }
+        case OP_SUB: {
+            f = x - y;
+            dfx = Real(1.0);
+            dfy = Real(-1.0);
+            ddf = Real(0.0);
+            break;
+        }
+        default: { // OP_MUL
+            f = x * y;
+            dfx = y;
+            dfy = x;
+            ddf = Real(1.0);
+            break;
+        }
+    }
+}
+
+inline AReal UnaryOp(ADGraph &graph, const ADOpCode code, const AReal &x, const Real c = Real(0.0)) {
+    Real f, df, ddf;
+    EvalUnary(code, x.val, c, f, df, ddf);
+    AReal ret = NewAReal(graph, f);
+    AddEdge(graph, ret, x, df, ddf);
+    RecordOp(graph, ret, code, x.varId, x.varId, c);
+    return ret;
+}
+inline AReal UnaryOp(const ADOpCode code, const AReal &x, const Real c = Real(0.0)) {
+    return UnaryOp(*g_ADGraph, code, x, c);
+}
+
+// Unary operation on a temporary (see ADGraph::fuseUnary): if x is the last vertex and has 
+// a single edge, the operation is fused into its vertex with the chain rule, 
+// d(f(g))/dp = f'(g) g' & d^2(f(g))/dp^2 = f''(g) g'^2 + f'(g) g''
+inline AReal UnaryOp(const ADOpCode code, AReal &&x, const Real c = Real(0.0)) {
+    ADGraph &graph = *g_ADGraph;
+    const VertexId vid = x.varId;
+    if (!graph.fuseUnary || graph.recordOps || vid + 1 != graph.vertices.size() || 
+            graph.vertices[vid].e1.to == vid || graph.vertices[vid].e2.to != vid) {
+        return UnaryOp(code, static_cast<const AReal&>(x), c);
+    }
+    ADVertex &vertex = graph.vertices[vid];
+    Real f, df, ddf;
+    EvalUnary(code, x.val, c, f, df, ddf);
+    const Real dg = vertex.e1.w;
+    vertex.soW = Weight(ddf * dg * dg + df * vertex.soW);
+    vertex.e1.w = Weight(df * dg);
+    return AReal(f, vid);
+}
+
+inline AReal BinaryOp(ADGraph &graph, const ADOpCode code, const AReal &l, const AReal &r) {
+    Real f, dfx, dfy, ddf;
+    EvalBinary(code, l.val, r.val, f, dfx, dfy, ddf);
+    AReal ret = NewAReal(graph, f);
+    AddEdge(graph, ret, l, r, dfx, dfy, ddf);
+    RecordOp(graph, ret, code, l.varId, r.varId, Real(0.0));
+    return ret;
+}
+inline AReal BinaryOp(const ADOpCode code, const AReal &l, const AReal &r) {
+    return BinaryOp(*g_ADGraph, code, l, r);
+}
 
 ////////////////////// Addition ///////////////////////////
 inline AReal operator+(const AReal &l, const AReal &r) {
-    AReal ret = NewAReal(l.val + r.val);
-    AddEdge(ret, l, r, Real(1.0), Real(1.0), Real(0.0));
-    return ret;
+    return BinaryOp(OP_ADD, l, r);
 }
 inline AReal operator+(const AReal &l, const Real r) {
-    AReal ret = NewAReal(l.val + r);
-    AddEdge(ret, l, Real(1.0), Real(0.0));
-    return ret;
+    return UnaryOp(OP_ADD_CONST, l, r);
 }
 inline AReal operator+(const Real l, const AReal &r) {
     return r + l;
@@ -270,19 +1209,13 @@ inline AReal& operator+=(AReal &l, const Real r) {
 
 ////////////////// Subtraction ////////////////////////////
 inline AReal operator-(const AReal &l, const AReal &r) {
-    AReal ret = NewAReal(l.val - r.val);
-    AddEdge(ret, l, r, Real(1.0), -Real(1.0), Real(0.0));
-    return ret;
+    return BinaryOp(OP_SUB, l, r);
 }
 inline AReal operator-(const AReal &l, const Real r) {
-    AReal ret = NewAReal(l.val - r);
-    AddEdge(ret, l, Real(1.0), Real(0.0));
-    return ret;
+    return UnaryOp(OP_ADD_CONST, l, -r);
 }
 inline AReal operator-(const Real l, const AReal &r) {
-    AReal ret = NewAReal(l - r.val);
-    AddEdge(ret, r, Real(-1.0), Real(0.0));
-    return ret;
+    return UnaryOp(OP_CONST_SUB, r, l);
 }
 inline AReal& operator-=(AReal &l, const AReal &r) {
     return (l = l - r);
@@ -291,22 +1224,16 @@ inline AReal& operator-=(AReal &l, const Real r) {
     return (l = l - r);
 }
 inline AReal operator-(const AReal &x) {
-    AReal ret = NewAReal(-x.val);
-    AddEdge(ret, x, Real(-1.0), Real(0.0));
-    return ret;
+    return UnaryOp(OP_CONST_SUB, x, Real(0.0));
 }
 ///////////////////////////////////////////////////////////
 
 ////////////////// Multiplication /////////////////////////
 inline AReal operator*(const AReal &l, const AReal &r) {
-    AReal ret = NewAReal(l.val * r.val);
-    AddEdge(ret, l, r, r.val, l.val, Real(1.0));
-    return ret;
+    return BinaryOp(OP_MUL, l, r);
 }
 inline AReal operator*(const AReal &l, const Real r) {
-    AReal ret = NewAReal(l.val * r);
-    AddEdge(ret, l, r, Real(0.0));
-    return ret;
+    return UnaryOp(OP_MUL_CONST, l, r);
 }
 inline AReal operator*(const Real l, const AReal &r) {
     return r * l;
@@ -321,12 +1248,7 @@ inline AReal& operator*=(AReal &l, const Real r) {
 
 ////////////////// Inversion //////////////////////////////
 inline AReal Inv(const AReal &x) {
-    Real invX = Real(1.0) / x.val;
-    Real invXSq = invX * invX;
-    Real invXCu = invXSq * invX;
-    AReal ret = NewAReal(invX);
-    AddEdge(ret, x, -invXSq, Real(2.0) * invXCu);
-    return ret;
+    return UnaryOp(OP_INV, x);
 }
 inline Real Inv(const Real x) {
     return Real(1.0) / x;
@@ -352,20 +1274,39 @@ inline AReal& operator/=(AReal &l, const Real r) {
 ///////////////////////////////////////////////////////////
 
 ////////////////// Comparisons ////////////////////////////
-inline bool operator<(const AReal &l, const AReal &r) {
-    return l.val < r.val;
+inline bool Compare(const ADCmpCode code, const Real l, const Real r) {
+    switch (code) {
+        case CMP_LT: return l < r;
+        case CMP_LE: return l <= r;
+        case CMP_GT: return l > r;
+        case CMP_GE: return l >= r;
+        default: return l == r;
+    }
+}
+inline bool CompareOp(ADGraph &graph, const ADCmpCode code, const AReal &l, const AReal &r) {
+    bool result = Compare(code, l.val, r.val);
+    if (graph.recordOps) {
+        graph.guards.push_back(ADGuard(code, l.varId, r.varId, result));
+    }
+    return result;
+}
+inline bool CompareOp(const ADCmpCode code, const AReal &l, const AReal &r) {
+    return CompareOp(*g_ADGraph, code, l, r);
+}
+inline bool operator<(const AReal &l, const AReal &r) {
+    return CompareOp(CMP_LT, l, r);
 }
 inline bool operator<=(const AReal &l, const AReal &r) {
-    return l.val <= r.val;
+    return CompareOp(CMP_LE, l, r);
 }
 inline bool operator>(const AReal &l, const AReal &r) {
-    return l.val > r.val;
+    return CompareOp(CMP_GT, l, r);
 }
 inline bool operator>=(const AReal &l, const AReal &r) {
-    return l.val >= r.val;
+    return CompareOp(CMP_GE, l, r);
 }
 inline bool operator==(const AReal &l, const AReal &r) {
-    return l.val == r.val;
+    return CompareOp(CMP_EQ, l, r);
 }
 ///////////////////////////////////////////////////////////
 
@@ -374,185 +1315,3260 @@ inline Real square(const Real x) {
     return x * x;
 }
 inline AReal square(const AReal &x) {
-    Real sqX = x.val * x.val;
-    AReal ret = NewAReal(sqX);
-    AddEdge(ret, x, Real(2.0) * x.val, Real(0.0));
-    return ret;
+    return UnaryOp(OP_SQUARE, x);
 }
 inline AReal sqrt(const AReal &x) {
-    Real sqrtX = std::sqrt(x.val);
-    Real invSqrtX = Real(1.0) / sqrtX;
-    AReal ret = NewAReal(sqrtX);
-    AddEdge(ret, x, Real(0.5) * invSqrtX, - Real(0.25) * invSqrtX / x.val);
-    return ret;
+    return UnaryOp(OP_SQRT, x);
 }
 inline AReal pow(const AReal &x, const Real a) {
-    Real powX = std::pow(x.val, a);
-    AReal ret = NewAReal(powX);
-    AddEdge(ret, x, a * std::pow(x.val, a - Real(1.0)),
-                    a * (a - Real(1.0)) * std::pow(x.val, a - Real(2.0)));
-    return ret;
+    return UnaryOp(OP_POW, x, a);
 }
 inline AReal exp(const AReal &x) {
-    Real expX = std::exp(x.val);
-    AReal ret = NewAReal(expX);
-    AddEdge(ret, x, expX, expX);
-    return ret;
+    return UnaryOp(OP_EXP, x);
 }
 inline AReal log(const AReal &x) {
-    Real logX = std::log(x.val);
-    AReal ret = NewAReal(logX);
-    Real invX = Real(1.0) / x.val;
-    AddEdge(ret, x, invX, - invX * invX);
-    return ret;
+    return UnaryOp(OP_LOG, x);
 }
 inline AReal sin(const AReal &x) {
-    Real sinX = std::sin(x.val);
-    AReal ret = NewAReal(sinX);
-    AddEdge(ret, x, std::cos(x.val), -sinX);
-    return ret;
+    return UnaryOp(OP_SIN, x);
 }
 inline AReal cos(const AReal &x) {
-    Real cosX = std::cos(x.val);
-    AReal ret = NewAReal(cosX);
-    AddEdge(ret, x, -std::sin(x.val), -cosX);
-    return ret;
+    return UnaryOp(OP_COS, x);
 }
 inline AReal tan(const AReal &x) {
-    Real tanX = std::tan(x.val);
-    Real secX = Real(1.0) / std::cos(x.val);
-    Real sec2X = secX * secX;
-    AReal ret = NewAReal(tanX);
-    AddEdge(ret, x, sec2X, Real(2.0) * tanX * sec2X);
-    return ret;
+    return UnaryOp(OP_TAN, x);
 }
 inline AReal asin(const AReal &x) {
-    Real asinX = std::asin(x.val);
-    AReal ret = NewAReal(asinX);
-    Real tmp = Real(1.0) / (Real(1.0) - x.val * x.val);
-    Real sqrtTmp = std::sqrt(tmp);
-    AddEdge(ret, x, sqrtTmp, x.val * sqrtTmp * tmp);
-    return ret;
+    return UnaryOp(OP_ASIN, x);
 }
 inline AReal acos(const AReal &x) {
-    Real acosX = std::acos(x.val);
-    AReal ret = NewAReal(acosX);
-    Real tmp = Real(1.0) / (Real(1.0) - x.val * x.val);
-    Real negSqrtTmp = -std::sqrt(tmp);
-    AddEdge(ret, x, negSqrtTmp, x.val * negSqrtTmp * tmp);
-    return ret;
+    return UnaryOp(OP_ACOS, x);
 }
-///////////////////////////////////////////////////////////
 
-inline void SetAdjoint(const AReal &v, const Real adj) {
-    g_ADGraph->vertices[v.varId].w = adj;
+// Unary functions of temporaries, fused into the vertex of their argument if ADGraph::fuseUnary is true
+#define HAD_FUSED_UNARY(FUNC, CODE) \
+inline AReal FUNC(AReal &&x) { \
+    return UnaryOp(CODE, std::move(x)); \
 }
-
-inline Real GetAdjoint(const AReal &v) {
-    return g_ADGraph->vertices[v.varId].w;
+HAD_FUSED_UNARY(square, OP_SQUARE)
+HAD_FUSED_UNARY(sqrt, OP_SQRT)
+HAD_FUSED_UNARY(exp, OP_EXP)
+HAD_FUSED_UNARY(log, OP_LOG)
+HAD_FUSED_UNARY(sin, OP_SIN)
+HAD_FUSED_UNARY(cos, OP_COS)
+HAD_FUSED_UNARY(tan, OP_TAN)
+HAD_FUSED_UNARY(asin, OP_ASIN)
+HAD_FUSED_UNARY(acos, OP_ACOS)
+HAD_FUSED_UNARY(Inv, OP_INV)
+#undef HAD_FUSED_UNARY
+inline AReal pow(AReal &&x, const Real a) {
+    return UnaryOp(OP_POW, std::move(x), a);
+}
+inline AReal operator+(AReal &&l, const Real r) {
+    return UnaryOp(OP_ADD_CONST, std::move(l), r);
+}
+inline AReal operator+(const Real l, AReal &&r) {
+    return UnaryOp(OP_ADD_CONST, std::move(r), l);
+}
+inline AReal operator-(AReal &&l, const Real r) {
+    return UnaryOp(OP_ADD_CONST, std::move(l), -r);
+}
+inline AReal operator-(const Real l, AReal &&r) {
+    return UnaryOp(OP_CONST_SUB, std::move(r), l);
+}
+inline AReal operator-(AReal &&x) {
+    return UnaryOp(OP_CONST_SUB, std::move(x), Real(0.0));
+}
+inline AReal operator*(AReal &&l, const Real r) {
+    return UnaryOp(OP_MUL_CONST, std::move(l), r);
+}
+inline AReal operator*(const Real l, AReal &&r) {
+    return UnaryOp(OP_MUL_CONST, std::move(r), l);
+}
+inline AReal operator/(AReal &&l, const Real r) {
+    return UnaryOp(OP_MUL_CONST, std::move(l), Real(1.0) / r);
+}
+inline AReal operator/(const Real l, AReal &&r) {
+    return l * Inv(std::move(r));
 }
 
-inline Real GetAdjoint(const AReal &i, const AReal &j) {
-    if (i.varId == j.varId) {
-        return g_ADGraph->selfSoEdges[i.varId];
-    } else {
-        return g_ADGraph->soEdges[std::max(i.varId, j.varId)].Query(std::min(i.varId, j.varId));
+// A variable bound to the graph it is recorded in: the operations on ABoundReals
+// record into that graph (the one of the left operand for binary operations) 
+// without looking up g_ADGraph, so several graphs can be recorded statement by statement 
+// in one thread. The operands of a binary operation must be bound to the same graph.
+struct ABoundReal {
+    ABoundReal() : graph(0) {}
+    // A new variable of graph
+    ABoundReal(ADGraph &graph, const Real val) : var(NewAReal(graph, val)), graph(&graph) {}
+    // Bind a variable already recorded in graph
+    ABoundReal(ADGraph &graph, const AReal &var) : var(var), graph(&graph) {}
+
+    AReal var;
+    ADGraph *graph;
+};
+
+#define HAD_BOUND_BINARY(OPERATOR, CODE) \
+    inline ABoundReal operator OPERATOR(const ABoundReal &l, const ABoundReal &r) { \
+        return ABoundReal(*l.graph, BinaryOp(*l.graph, CODE, l.var, r.var)); \
+    } \
+    inline ABoundReal& operator OPERATOR##=(ABoundReal &l, const ABoundReal &r) { \
+        return (l = l OPERATOR r); \
     }
+HAD_BOUND_BINARY(+, OP_ADD)
+HAD_BOUND_BINARY(-, OP_SUB)
+HAD_BOUND_BINARY(*, OP_MUL)
+#undef HAD_BOUND_BINARY
+inline ABoundReal operator+(const ABoundReal &l, const Real r) {
+    return ABoundReal(*l.graph, UnaryOp(*l.graph, OP_ADD_CONST, l.var, r));
+}
+inline ABoundReal operator+(const Real l, const ABoundReal &r) {
+    return r + l;
+}
+inline ABoundReal operator-(const ABoundReal &l, const Real r) {
+    return l + (-r);
+}
+inline ABoundReal operator-(const Real l, const ABoundReal &r) {
+    return ABoundReal(*r.graph, UnaryOp(*r.graph, OP_CONST_SUB, r.var, l));
+}
+inline ABoundReal operator-(const ABoundReal &x) {
+    return Real(0.0) - x;
+}
+inline ABoundReal operator*(const ABoundReal &l, const Real r) {
+    return ABoundReal(*l.graph, UnaryOp(*l.graph, OP_MUL_CONST, l.var, r));
+}
+inline ABoundReal operator*(const Real l, const ABoundReal &r) {
+    return r * l;
+}
+inline ABoundReal& operator+=(ABoundReal &l, const Real r) {
+    return (l = l + r);
+}
+inline ABoundReal& operator-=(ABoundReal &l, const Real r) {
+    return (l = l - r);
+}
+inline ABoundReal& operator*=(ABoundReal &l, const Real r) {
+    return (l = l * r);
 }
 
-inline VertexId SingleEdgePropagate(VertexId x, Real &a) {
-    bool cont = g_ADGraph->vertices[x].e1.to != x &&
-                g_ADGraph->vertices[x].e2.to == x;
-    while (cont) {
-        a *= g_ADGraph->vertices[x].e1.w;
-        x = g_ADGraph->vertices[x].e1.to;
-        cont = g_ADGraph->vertices[x].e1.to != x &&
-               g_ADGraph->vertices[x].e2.to == x;
+#define HAD_BOUND_UNARY(FUNC, CODE) \
+    inline ABoundReal FUNC(const ABoundReal &x) { \
+        return ABoundReal(*x.graph, UnaryOp(*x.graph, CODE, x.var)); \
     }
-    return x;
+HAD_BOUND_UNARY(square, OP_SQUARE)
+HAD_BOUND_UNARY(sqrt, OP_SQRT)
+HAD_BOUND_UNARY(exp, OP_EXP)
+HAD_BOUND_UNARY(log, OP_LOG)
+HAD_BOUND_UNARY(sin, OP_SIN)
+HAD_BOUND_UNARY(cos, OP_COS)
+HAD_BOUND_UNARY(tan, OP_TAN)
+HAD_BOUND_UNARY(asin, OP_ASIN)
+HAD_BOUND_UNARY(acos, OP_ACOS)
+HAD_BOUND_UNARY(Inv, OP_INV)
+#undef HAD_BOUND_UNARY
+inline ABoundReal pow(const ABoundReal &x, const Real a) {
+    return ABoundReal(*x.graph, UnaryOp(*x.graph, OP_POW, x.var, a));
 }
 
-inline void PushEdge(const ADEdge &foEdge, const ADEdge &soEdge) {
-    if (foEdge.to == soEdge.to) {
-        g_ADGraph->selfSoEdges[foEdge.to] += Real(2.0) * foEdge.w * soEdge.w;
-    } else {
-        g_ADGraph->soEdges[std::max(foEdge.to, soEdge.to)].Insert(
-            std::min(foEdge.to, soEdge.to), foEdge.w * soEdge.w);
+inline ABoundReal operator/(const ABoundReal &l, const ABoundReal &r) {
+    return l * Inv(r);
+}
+inline ABoundReal operator/(const ABoundReal &l, const Real r) {
+    return l * Inv(r);
+}
+inline ABoundReal operator/(const Real l, const ABoundReal &r) {
+    return l * Inv(r);
+}
+inline ABoundReal& operator/=(ABoundReal &l, const ABoundReal &r) {
+    return (l = l / r);
+}
+inline ABoundReal& operator/=(ABoundReal &l, const Real r) {
+    return (l = l / r);
+}
+
+#define HAD_BOUND_COMPARE(OPERATOR, CODE) \
+    inline bool operator OPERATOR(const ABoundReal &l, const ABoundReal &r) { \
+        return CompareOp(*l.graph, CODE, l.var, r.var); \
+    }
+HAD_BOUND_COMPARE(<, CMP_LT)
+HAD_BOUND_COMPARE(<=, CMP_LE)
+HAD_BOUND_COMPARE(>, CMP_GT)
+HAD_BOUND_COMPARE(>=, CMP_GE)
+HAD_BOUND_COMPARE(==, CMP_EQ)
+#undef HAD_BOUND_COMPARE
+
+// Elementwise operation over arrays, out[i] = op(in[i]) for i < n (in may be equal to out).
+// The n vertices are appended at once (uninitialized) and the values & partials are computed 
+// block by block in branch-free loops that the compiler can vectorize (the libm calls as well 
+// with e.g. -O3 -ffast-math on glibc), before being written into the vertices
+const int kUnaryBlockSize = 256;
+
+template <ADOpCode code>
+inline void EvalUnaryBlock(const Real *x, const Real c, const int n, 
+                           Real *f, Real *df, Real *ddf) {
+    for (int i = 0; i < n; i++) {
+        EvalUnary(code, x[i], c, f[i], df[i], ddf[i]);
     }
 }
 
-inline void PropagateAdjoint() {
-    if (g_ADGraph->vertices.size() > g_ADGraph->soEdges.size()) {
-        g_ADGraph->soEdges.resize(g_ADGraph->vertices.size());
-    } else {
-        for (int i = 0; i < (int)g_ADGraph->soEdges.size(); i++) {
-            g_ADGraph->soEdges[i].Clear();
+inline void UnaryOp(const ADOpCode code, const AReal *in, AReal *out, 
+                    const size_t n, const Real c = Real(0.0)) {
+    ADGraph &graph = *g_ADGraph;
+    const VertexId first = graph.vertices.size();
+    graph.vertices.resize(first + n);
+    if (graph.recordOps) {
+        graph.ops.resize(first + n, ADOp(code, Real(0.0)));
+    }
+    Real x[kUnaryBlockSize], f[kUnaryBlockSize], df[kUnaryBlockSize], ddf[kUnaryBlockSize];
+    VertexId parents[kUnaryBlockSize];
+    for (size_t begin = 0; begin < n; begin += kUnaryBlockSize) {
+        const int size = (int)std::min(n - begin, (size_t)kUnaryBlockSize);
+        for (int i = 0; i < size; i++) {
+            x[i] = in[begin + i].val;
+            parents[i] = in[begin + i].varId;
+        }
+        switch (code) {
+            case OP_SQUARE: EvalUnaryBlock<OP_SQUARE>(x, c, size, f, df, ddf); break;
+            case OP_SQRT: EvalUnaryBlock<OP_SQRT>(x, c, size, f, df, ddf); break;
+            case OP_POW: EvalUnaryBlock<OP_POW>(x, c, size, f, df, ddf); break;
+            case OP_EXP: EvalUnaryBlock<OP_EXP>(x, c, size, f, df, ddf); break;
+            case OP_LOG: EvalUnaryBlock<OP_LOG>(x, c, size, f, df, ddf); break;
+            case OP_SIN: EvalUnaryBlock<OP_SIN>(x, c, size, f, df, ddf); break;
+            case OP_COS: EvalUnaryBlock<OP_COS>(x, c, size, f, df, ddf); break;
+            case OP_TAN: EvalUnaryBlock<OP_TAN>(x, c, size, f, df, ddf); break;
+            case OP_ASIN: EvalUnaryBlock<OP_ASIN>(x, c, size, f, df, ddf); break;
+            case OP_ACOS: EvalUnaryBlock<OP_ACOS>(x, c, size, f, df, ddf); break;
+            default: {
+                for (int i = 0; i < size; i++) {
+                    EvalUnary(code, x[i], c, f[i], df[i], ddf[i]);
+                }
+                break;
+            }
+        }
+        ADVertex *vertices = graph.vertices.data() + first + begin;
+        for (int i = 0; i < size; i++) {
+            const VertexId vid = first + (VertexId)(begin + i);
+            vertices[i].e1 = ADEdge(parents[i], df[i]);
+            vertices[i].e2 = ADEdge(vid);
+            vertices[i].w = Real(0.0);
+            vertices[i].soW = ddf[i];
+            out[begin + i] = AReal(f[i], vid);
+        }
+        if (graph.recordOps) {
+            ADOp *ops = graph.ops.data() + first + begin;
+            for (int i = 0; i < size; i++) {
+                ops[i].a = ops[i].b = parents[i];
+                ops[i].c = c;
+                ops[i].val = f[i];
+            }
         }
     }
-    g_ADGraph->selfSoEdges.resize(g_ADGraph->vertices.size(), Real(0.0));
-    // Any chance for SSE/AVX parallism?
+}
 
-    for (VertexId vid = g_ADGraph->vertices.size() - 1; vid > 0; vid--) {
-        ADVertex &vertex = g_ADGraph->vertices[vid];
-        ADEdge &e1 = vertex.e1;
-        ADEdge &e2 = vertex.e2;
-        if (e1.to == vid) {
-            continue;
+inline void square(const AReal *in, AReal *out, const size_t n) {
+    UnaryOp(OP_SQUARE, in, out, n);
+}
+inline void sqrt(const AReal *in, AReal *out, const size_t n) {
+    UnaryOp(OP_SQRT, in, out, n);
+}
+inline void pow(const AReal *in, const Real a, AReal *out, const size_t n) {
+    UnaryOp(OP_POW, in, out, n, a);
+}
+inline void exp(const AReal *in, AReal *out, const size_t n) {
+    UnaryOp(OP_EXP, in, out, n);
+}
+inline void log(const AReal *in, AReal *out, const size_t n) {
+    UnaryOp(OP_LOG, in, out, n);
+}
+inline void sin(const AReal *in, AReal *out, const size_t n) {
+    UnaryOp(OP_SIN, in, out, n);
+}
+inline void cos(const AReal *in, AReal *out, const size_t n) {
+    UnaryOp(OP_COS, in, out, n);
+}
+inline void tan(const AReal *in, AReal *out, const size_t n) {
+    UnaryOp(OP_TAN, in, out, n);
+}
+inline void asin(const AReal *in, AReal *out, const size_t n) {
+    UnaryOp(OP_ASIN, in, out, n);
+}
+inline void acos(const AReal *in, AReal *out, const size_t n) {
+    UnaryOp(OP_ACOS, in, out, n);
+}
+///////////////////////////////////////////////////////////
+
+//////////////// Expression templates /////////////////////
+// Expr(x) starts an expression template: the operations on it are not recorded 
+// one by one, the whole expression is folded into a single vertex with the 
+// first-order and second-order partials with respect to its variables 
+// when it is assigned to an AReal. 
+// e.g. AReal y = Expr(x0) * x1 + sin(Expr(x0)) * x2 adds one vertex instead of five.
+
+// Value, gradient and Hessian of an expression with respect to its N leaves
+// (a variable used twice in the expression gives two leaves)
+template <int N>
+struct AJet {
+    Real val;
+    VertexId ids[N];
+    Real g[N];
+    Real h[N][N];
+};
+
+template <typename E>
+struct AExpr {
+    inline const E& Derived() const {
+        return static_cast<const E&>(*this);
+    }
+};
+
+struct ALeaf : public AExpr<ALeaf> {
+    static const int N = 1;
+
+    ALeaf(const AReal &x) : val(x.val), varId(x.varId) {}
+
+    inline void Eval(AJet<N> &jet) const {
+        jet.val = val;
+        jet.ids[0] = varId;
+        jet.g[0] = Real(1.0);
+        jet.h[0][0] = Real(0.0);
+    }
+
+    // Record the expression vertex by vertex
+    inline AReal Record() const {
+        return AReal(val, varId);
+    }
+
+    Real val;
+    VertexId varId;
+};
+
+template <ADOpCode Op, typename E>
+struct AUnaryExpr : public AExpr<AUnaryExpr<Op, E> > {
+    static const int N = E::N;
+
+    AUnaryExpr(const E &x, const Real c = Real(0.0)) : x(x), c(c) {}
+
+    inline void Eval(AJet<N> &jet) const {
+        x.Eval(jet);
+        Real f, df, ddf;
+        EvalUnary(Op, jet.val, c, f, df, ddf);
+        jet.val = f;
+        for (int i = 0; i < N; i++) {
+            for (int j = 0; j < N; j++) {
+                jet.h[i][j] = df * jet.h[i][j] + ddf * jet.g[i] * jet.g[j];
+            }
+        }
+        for (int i = 0; i < N; i++) {
+            jet.g[i] *= df;
         }
+    }
 
-        // Pushing
-        BTree &btree = g_ADGraph->soEdges[vid];
-        std::vector<BTNode>::iterator it;
-        if (e2.to == vid) {
-            for (it = btree.nodes.begin(); it != btree.nodes.end(); it++) {
-                ADEdge soEdge(it->key, it->val);
-                PushEdge(e1, soEdge);
+    inline AReal Record() const {
+        return UnaryOp(Op, x.Record(), c);
+    }
+
+    E x;
+    Real c;
+};
+
+template <ADOpCode Op, typename L, typename R>
+struct ABinaryExpr : public AExpr<ABinaryExpr<Op, L, R> > {
+    static const int NL = L::N;
+    static const int NR = R::N;
+    static const int N = NL + NR;
+
+    ABinaryExpr(const L &l, const R &r) : l(l), r(r) {}
+
+    inline void Eval(AJet<N> &jet) const {
+        AJet<NL> jl;
+        AJet<NR> jr;
+        l.Eval(jl);
+        r.Eval(jr);
+        // d^2f/dx^2 & d^2f/dy^2 are zero for all the binary operations
+        Real dfx, dfy, ddf;
+        EvalBinary(Op, jl.val, jr.val, jet.val, dfx, dfy, ddf);
+        for (int i = 0; i < NL; i++) {
+            jet.ids[i] = jl.ids[i];
+            jet.g[i] = dfx * jl.g[i];
+            for (int j = 0; j < NL; j++) {
+                jet.h[i][j] = dfx * jl.h[i][j];
             }
-        } else {
-            for (it = btree.nodes.begin(); it != btree.nodes.end(); it++) {
-                ADEdge soEdge(it->key, it->val);
-                PushEdge(e1, soEdge);
-                PushEdge(e2, soEdge);
+            for (int j = 0; j < NR; j++) {
+                jet.h[i][NL + j] = jet.h[NL + j][i] = ddf * jl.g[i] * jr.g[j];
             }
         }
-        if (g_ADGraph->selfSoEdges[vid] != Real(0.0)) {
-            g_ADGraph->selfSoEdges[e1.to] += e1.w * e1.w * g_ADGraph->selfSoEdges[vid];
-            if (e2.to != vid) {
-                g_ADGraph->selfSoEdges[e2.to] += e2.w * e2.w * g_ADGraph->selfSoEdges[vid];
-                if (e1.to == e2.to) {
-                    g_ADGraph->selfSoEdges[e2.to] += Real(2.0) * e1.w * e2.w * g_ADGraph->selfSoEdges[vid];
-                } else {
-                    g_ADGraph->soEdges[std::max(e1.to, e2.to)].Insert(std::min(e1.to, e2.to), 
-                                                   e1.w * e2.w * g_ADGraph->selfSoEdges[vid]);
-                }
+        for (int i = 0; i < NR; i++) {
+            jet.ids[NL + i] = jr.ids[i];
+            jet.g[NL + i] = dfy * jr.g[i];
+            for (int j = 0; j < NR; j++) {
+                jet.h[NL + i][NL + j] = dfy * jr.h[i][j];
             }
         }
+    }
+
+    inline AReal Record() const {
+        return BinaryOp(Op, l.Record(), r.Record());
+    }
 
-        // release memory?
+    L l;
+    R r;
+};
 
-        Real a = vertex.w;
-        if (a != Real(0.0)) {
-            // Creating
-            if (vertex.soW != Real(0.0)) {
-                if (e2.to == vid) { // single-edge
-                    g_ADGraph->selfSoEdges[e1.to] += a * vertex.soW;
-                } else if (e1.to == e2.to) {
-                    g_ADGraph->selfSoEdges[e1.to] += Real(2.0) * a * vertex.soW;
-                } else {
-                    g_ADGraph->soEdges[std::max(e1.to, e2.to)].Insert(std::min(e1.to, e2.to),
-                        a * vertex.soW);
-                }
+inline ALeaf Expr(const AReal &x) {
+    return ALeaf(x);
+}
+
+// Add the vertex of an expression: a single-edge or two-edge vertex if possible, 
+// otherwise a n-ary vertex. The expression is recorded vertex by vertex instead 
+// if the operations are recorded for Replay().
+template <typename E>
+inline AReal Fold(const AExpr<E> &expr) {
+    const E &e = expr.Derived();
+    if (g_ADGraph->recordOps) {
+        return e.Record();
+    }
+    const int N = E::N;
+    AJet<N> jet;
+    e.Eval(jet);
+
+    // Merge the leaves of the same variable
+    int index[N];
+    VertexId ids[N];
+    Real g[N];
+    Real h[N][N];
+    int m = 0;
+    for (int i = 0; i < N; i++) {
+        index[i] = m;
+        for (int k = 0; k < m; k++) {
+            if (ids[k] == jet.ids[i]) {
+                index[i] = k;
+                break;
             }
-            // Adjoint
-            vertex.w = Real(0.0);
-            g_ADGraph->vertices[e1.to].w += a * e1.w;
-            if (e2.to != vid) {
-                g_ADGraph->vertices[e2.to].w += a * e2.w;
+        }
+        if (index[i] == m) {
+            ids[m] = jet.ids[i];
+            g[m] = Real(0.0);
+            for (int k = 0; k <= m; k++) {
+                h[m][k] = h[k][m] = Real(0.0);
+            }
+            m++;
+        }
+        g[index[i]] += jet.g[i];
+    }
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < N; j++) {
+            h[index[i]][index[j]] += jet.h[i][j];
+        }
+    }
+
+    AReal ret = NewAReal(jet.val);
+    if (m == 1) {
+        AddEdge(ret, AReal(Real(0.0), ids[0]), g[0], h[0][0]);
+    } else if (m == 2 && h[0][0] == Real(0.0) && h[1][1] == Real(0.0)) {
+        AddEdge(ret, AReal(Real(0.0), ids[0]), AReal(Real(0.0), ids[1]), g[0], g[1], h[1][0]);
+    } else {
+        ADEdge edges[N];
+        ADSoEdge soEdges[N * (N + 1) / 2];
+        int numEdges = 0, numSoEdges = 0;
+        for (int i = 0; i < m; i++) {
+            if (g[i] != Real(0.0)) {
+                edges[numEdges++] = ADEdge(ids[i], g[i]);
+            }
+            for (int j = 0; j <= i; j++) {
+                if (h[i][j] != Real(0.0)) {
+                    soEdges[numSoEdges++] = ADSoEdge(ids[i], ids[j], h[i][j]);
+                }
             }
         }
+        AddNaryEdges(ret, edges, numEdges, soEdges, numSoEdges);
+    }
+    return ret;
+}
+
+template <typename E>
+inline AReal::AReal(const AExpr<E> &expr) {
+    *this = Fold(expr);
+}
+
+template <typename E>
+inline AReal& AReal::operator=(const AExpr<E> &expr) {
+    *this = Fold(expr);
+    return *this;
+}
+
+#define HAD_EXPR_BINARY(OP, CODE) \
+template <typename L, typename R> \
+inline ABinaryExpr<CODE, L, R> operator OP(const AExpr<L> &l, const AExpr<R> &r) { \
+    return ABinaryExpr<CODE, L, R>(l.Derived(), r.Derived()); \
+} \
+template <typename L> \
+inline ABinaryExpr<CODE, L, ALeaf> operator OP(const AExpr<L> &l, const AReal &r) { \
+    return ABinaryExpr<CODE, L, ALeaf>(l.Derived(), ALeaf(r)); \
+} \
+template <typename R> \
+inline ABinaryExpr<CODE, ALeaf, R> operator OP(const AReal &l, const AExpr<R> &r) { \
+    return ABinaryExpr<CODE, ALeaf, R>(ALeaf(l), r.Derived()); \
+}
+HAD_EXPR_BINARY(+, OP_ADD)
+HAD_EXPR_BINARY(-, OP_SUB)
+HAD_EXPR_BINARY(*, OP_MUL)
+#undef HAD_EXPR_BINARY
+
+template <typename E>
+inline AUnaryExpr<OP_ADD_CONST, E> operator+(const AExpr<E> &l, const Real r) {
+    return AUnaryExpr<OP_ADD_CONST, E>(l.Derived(), r);
+}
+template <typename E>
+inline AUnaryExpr<OP_ADD_CONST, E> operator+(const Real l, const AExpr<E> &r) {
+    return AUnaryExpr<OP_ADD_CONST, E>(r.Derived(), l);
+}
+template <typename E>
+inline AUnaryExpr<OP_ADD_CONST, E> operator-(const AExpr<E> &l, const Real r) {
+    return AUnaryExpr<OP_ADD_CONST, E>(l.Derived(), -r);
+}
+template <typename E>
+inline AUnaryExpr<OP_CONST_SUB, E> operator-(const Real l, const AExpr<E> &r) {
+    return AUnaryExpr<OP_CONST_SUB, E>(r.Derived(), l);
+}
+template <typename E>
+inline AUnaryExpr<OP_CONST_SUB, E> operator-(const AExpr<E> &x) {
+    return AUnaryExpr<OP_CONST_SUB, E>(x.Derived(), Real(0.0));
+}
+template <typename E>
+inline AUnaryExpr<OP_MUL_CONST, E> operator*(const AExpr<E> &l, const Real r) {
+    return AUnaryExpr<OP_MUL_CONST, E>(l.Derived(), r);
+}
+template <typename E>
+inline AUnaryExpr<OP_MUL_CONST, E> operator*(const Real l, const AExpr<E> &r) {
+    return AUnaryExpr<OP_MUL_CONST, E>(r.Derived(), l);
+}
+
+template <typename E>
+inline AUnaryExpr<OP_INV, E> Inv(const AExpr<E> &x) {
+    return AUnaryExpr<OP_INV, E>(x.Derived());
+}
+template <typename L, typename R>
+inline ABinaryExpr<OP_MUL, L, AUnaryExpr<OP_INV, R> > operator/(const AExpr<L> &l, const AExpr<R> &r) {
+    return l * Inv(r);
+}
+template <typename L>
+inline ABinaryExpr<OP_MUL, L, AUnaryExpr<OP_INV, ALeaf> > operator/(const AExpr<L> &l, const AReal &r) {
+    return l * Inv(Expr(r));
+}
+template <typename R>
+inline ABinaryExpr<OP_MUL, ALeaf, AUnaryExpr<OP_INV, R> > operator/(const AReal &l, const AExpr<R> &r) {
+    return l * Inv(r);
+}
+template <typename E>
+inline AUnaryExpr<OP_MUL_CONST, E> operator/(const AExpr<E> &l, const Real r) {
+    return AUnaryExpr<OP_MUL_CONST, E>(l.Derived(), Real(1.0) / r);
+}
+template <typename E>
+inline AUnaryExpr<OP_MUL_CONST, AUnaryExpr<OP_INV, E> > operator/(const Real l, const AExpr<E> &r) {
+    return l * Inv(r);
+}
+
+#define HAD_EXPR_UNARY(FUNC, CODE) \
+template <typename E> \
+inline AUnaryExpr<CODE, E> FUNC(const AExpr<E> &x) { \
+    return AUnaryExpr<CODE, E>(x.Derived()); \
+}
+HAD_EXPR_UNARY(square, OP_SQUARE)
+HAD_EXPR_UNARY(sqrt, OP_SQRT)
+HAD_EXPR_UNARY(exp, OP_EXP)
+HAD_EXPR_UNARY(log, OP_LOG)
+HAD_EXPR_UNARY(sin, OP_SIN)
+HAD_EXPR_UNARY(cos, OP_COS)
+HAD_EXPR_UNARY(tan, OP_TAN)
+HAD_EXPR_UNARY(asin, OP_ASIN)
+HAD_EXPR_UNARY(acos, OP_ACOS)
+#undef HAD_EXPR_UNARY
+
+template <typename E>
+inline AUnaryExpr<OP_POW, E> pow(const AExpr<E> &x, const Real a) {
+    return AUnaryExpr<OP_POW, E>(x.Derived(), a);
+}
+///////////////////////////////////////////////////////////
+
+//////////////// Reductions ///////////////////////////////
+// Sums, dot products and linear combinations of any number of terms are single n-ary vertices, 
+// so their edges are pushed in one batch instead of through a chain of binary vertices.
+// They are recorded as chains of binary operations if the operations are recorded for Replay().
+template <typename It>
+inline AReal Sum(It first, It last) {
+    if (first == last) {
+        return AReal(Real(0.0));
+    }
+    if (g_ADGraph->recordOps) {
+        AReal ret = *first;
+        for (It it = ++first; it != last; ++it) {
+            ret = ret + *it;
+        }
+        return ret;
+    }
+    ADGraph &graph = *g_ADGraph;
+    Real val = Real(0.0);
+    for (It it = first; it != last; ++it) {
+        val += it->val;
+    }
+    AReal ret = NewAReal(val);
+    const VertexId edgeBegin = graph.naryEdges.size();
+    for (It it = first; it != last; ++it) {
+        graph.naryEdges.push_back(ADEdge(it->varId, Real(1.0)));
+    }
+    SetNaryVertex(ret, edgeBegin, graph.narySoEdges.size());
+    return ret;
+}
+
+inline AReal Sum(const std::vector<AReal> &x) {
+    return Sum(x.begin(), x.end());
+}
+
+// sum_i coeffs[i] * x[i]
+inline AReal LinearCombination(const Real *coeffs, const std::vector<AReal> &x) {
+    if (x.empty()) {
+        return AReal(Real(0.0));
+    }
+    if (g_ADGraph->recordOps) {
+        AReal ret = coeffs[0] * x[0];
+        for (size_t i = 1; i < x.size(); i++) {
+            ret = ret + coeffs[i] * x[i];
+        }
+        return ret;
+    }
+    ADGraph &graph = *g_ADGraph;
+    Real val = Real(0.0);
+    for (size_t i = 0; i < x.size(); i++) {
+        val += coeffs[i] * x[i].val;
+    }
+    AReal ret = NewAReal(val);
+    const VertexId edgeBegin = graph.naryEdges.size();
+    for (size_t i = 0; i < x.size(); i++) {
+        graph.naryEdges.push_back(ADEdge(x[i].varId, coeffs[i]));
+    }
+    SetNaryVertex(ret, edgeBegin, graph.narySoEdges.size());
+    return ret;
+}
+
+inline AReal LinearCombination(const std::vector<Real> &coeffs, const std::vector<AReal> &x) {
+    return LinearCombination(coeffs.data(), x);
+}
+
+// sum_i a[i] * b[i]
+inline AReal Dot(const std::vector<AReal> &a, const std::vector<AReal> &b) {
+    if (a.empty()) {
+        return AReal(Real(0.0));
+    }
+    if (g_ADGraph->recordOps) {
+        AReal ret = a[0] * b[0];
+        for (size_t i = 1; i < a.size(); i++) {
+            ret = ret + a[i] * b[i];
+        }
+        return ret;
+    }
+    ADGraph &graph = *g_ADGraph;
+    Real val = Real(0.0);
+    for (size_t i = 0; i < a.size(); i++) {
+        val += a[i].val * b[i].val;
+    }
+    AReal ret = NewAReal(val);
+    const VertexId edgeBegin = graph.naryEdges.size(), soBegin = graph.narySoEdges.size();
+    for (size_t i = 0; i < a.size(); i++) {
+        graph.naryEdges.push_back(ADEdge(a[i].varId, b[i].val));
+        graph.naryEdges.push_back(ADEdge(b[i].varId, a[i].val));
+        // d^2(x * x)/dx^2 = 2
+        graph.narySoEdges.push_back(ADSoEdge(a[i].varId, b[i].varId, 
+            a[i].varId == b[i].varId ? Real(2.0) : Real(1.0)));
+    }
+    SetNaryVertex(ret, edgeBegin, soBegin);
+    return ret;
+}
+
+// sum_i x[i]^2
+inline AReal SquaredNorm(const std::vector<AReal> &x) {
+    if (x.empty()) {
+        return AReal(Real(0.0));
+    }
+    if (g_ADGraph->recordOps) {
+        AReal ret = square(x[0]);
+        for (size_t i = 1; i < x.size(); i++) {
+            ret = ret + square(x[i]);
+        }
+        return ret;
+    }
+    ADGraph &graph = *g_ADGraph;
+    Real val = Real(0.0);
+    for (size_t i = 0; i < x.size(); i++) {
+        val += x[i].val * x[i].val;
+    }
+    AReal ret = NewAReal(val);
+    const VertexId edgeBegin = graph.naryEdges.size(), soBegin = graph.narySoEdges.size();
+    for (size_t i = 0; i < x.size(); i++) {
+        graph.naryEdges.push_back(ADEdge(x[i].varId, Real(2.0) * x[i].val));
+        graph.narySoEdges.push_back(ADSoEdge(x[i].varId, x[i].varId, Real(2.0)));
+    }
+    SetNaryVertex(ret, edgeBegin, soBegin);
+    return ret;
+}
+
+struct HessianEntry {
+    HessianEntry() {}
+    HessianEntry(const int row, const int col, const Real val) :
+        row(row), col(col), val(val) {}
+
+    int row, col;
+    Real val;
+};
+
+// Append the second-order weight w = d^2f/dx[i]dx[j] of the n-ary vertex being built on the parents x 
+// to ADGraph::narySoEdges (two parents with the same id give a weight d^2f/dx^2 counted twice)
+inline void AddNarySoEdge(const std::vector<AReal> &x, const size_t i, const size_t j, Real w) {
+    if (w == Real(0.0)) {
+        return;
+    }
+    if (i != j && x[i].varId == x[j].varId) {
+        w *= Real(2.0);
+    }
+    g_ADGraph->narySoEdges.push_back(ADSoEdge(x[i].varId, x[j].varId, w));
+}
+
+// Append the second-order weights h(i, j), j <= i, of the n-ary vertex being built on the parents x
+template <typename H>
+inline void AddNarySoEdges(const std::vector<AReal> &x, H h) {
+    for (size_t i = 0; i < x.size(); i++) {
+        for (size_t j = 0; j <= i; j++) {
+            AddNarySoEdge(x, i, j, h(i, j));
+        }
+    }
+}
+
+// y = A * x, where A is a constant row-major matrix with x.size() columns, 
+// each y[i] is a single vertex
+inline void MatVec(const std::vector<Real> &A, const std::vector<AReal> &x, std::vector<AReal> &y) {
+    const size_t cols = x.size(), rows = cols == 0 ? 0 : A.size() / cols;
+    y.resize(rows);
+    for (size_t i = 0; i < rows; i++) {
+        y[i] = LinearCombination(&A[i * cols], x);
+    }
+}
+
+// x^T * A * x, where A is a constant row-major square matrix, 
+// with the Hessian A + A^T as the second-order weights of a single vertex
+inline AReal QuadForm(const std::vector<Real> &A, const std::vector<AReal> &x) {
+    const size_t n = x.size();
+    if (n == 0) {
+        return AReal(Real(0.0));
+    }
+    if (g_ADGraph->recordOps) {
+        std::vector<AReal> Ax;
+        MatVec(A, x, Ax);
+        return Dot(x, Ax);
+    }
+    ADGraph &graph = *g_ADGraph;
+    Real val = Real(0.0);
+    const VertexId edgeBegin = graph.naryEdges.size(), soBegin = graph.narySoEdges.size();
+    for (size_t i = 0; i < n; i++) {
+        // (A + A^T) x
+        Real g = Real(0.0);
+        for (size_t j = 0; j < n; j++) {
+            g += (A[i * n + j] + A[j * n + i]) * x[j].val;
+        }
+        val += Real(0.5) * g * x[i].val;
+        graph.naryEdges.push_back(ADEdge(x[i].varId, g));
     }
+    AddNarySoEdges(x, [&](const size_t i, const size_t j) {
+        return A[i * n + j] + A[j * n + i];
+    });
+    AReal ret = NewAReal(val);
+    SetNaryVertex(ret, edgeBegin, soBegin);
+    return ret;
 }
 
-} //namespace had
+// log(sum_i exp(x[i])), computed without overflow, with the Hessian diag(p) - p p^T 
+// (p = softmax(x)) as the second-order weights of a single vertex
+inline AReal LogSumExp(const std::vector<AReal> &x) {
+    const size_t n = x.size();
+    if (n == 0) {
+        return AReal(Real(0.0));
+    }
+    size_t k = 0;
+    for (size_t i = 1; i < n; i++) {
+        if (x[i].val > x[k].val) {
+            k = i;
+        }
+    }
+    const Real maxX = x[k].val;
+    if (g_ADGraph->recordOps) {
+        // shifted by the vertex of the maximum rather than by its value, 
+        // so that the exponentials do not overflow when replayed at larger inputs
+        std::vector<AReal> e(n);
+        for (size_t i = 0; i < n; i++) {
+            e[i] = exp(x[i] - x[k]);
+        }
+        return log(Sum(e)) + x[k];
+    }
+    ADGraph &graph = *g_ADGraph;
+    std::vector<Real> p(n);
+    Real sum = Real(0.0);
+    for (size_t i = 0; i < n; i++) {
+        p[i] = std::exp(x[i].val - maxX);
+        sum += p[i];
+    }
+    const VertexId edgeBegin = graph.naryEdges.size(), soBegin = graph.narySoEdges.size();
+    for (size_t i = 0; i < n; i++) {
+        p[i] /= sum;
+        graph.naryEdges.push_back(ADEdge(x[i].varId, p[i]));
+    }
+    AddNarySoEdges(x, [&](const size_t i, const size_t j) {
+        return i == j ? p[i] - p[i] * p[i] : - p[i] * p[j];
+    });
+    AReal ret = NewAReal(maxX + std::log(sum));
+    SetNaryVertex(ret, edgeBegin, soBegin);
+    return ret;
+}
+
+// sqrt(sum_i x[i]^2), with the Hessian (I - u u^T) / r (u = x / r) 
+// as the second-order weights of a single vertex
+inline AReal Norm2(const std::vector<AReal> &x) {
+    if (g_ADGraph->recordOps) {
+        return sqrt(SquaredNorm(x));
+    }
+    ADGraph &graph = *g_ADGraph;
+    const size_t n = x.size();
+    Real r = Real(0.0);
+    for (size_t i = 0; i < n; i++) {
+        r += x[i].val * x[i].val;
+    }
+    r = std::sqrt(r);
+    const Real invR = Real(1.0) / r;
+    std::vector<Real> u(n);
+    const VertexId edgeBegin = graph.naryEdges.size(), soBegin = graph.narySoEdges.size();
+    for (size_t i = 0; i < n; i++) {
+        u[i] = x[i].val * invR;
+        graph.naryEdges.push_back(ADEdge(x[i].varId, u[i]));
+    }
+    AddNarySoEdges(x, [&](const size_t i, const size_t j) {
+        return ((i == j ? Real(1.0) : Real(0.0)) - u[i] * u[j]) * invR;
+    });
+    AReal ret = NewAReal(r);
+    SetNaryVertex(ret, edgeBegin, soBegin);
+    return ret;
+}
+
+// The first-order edges of an external function of x with the given gradient
+inline void AddNaryGradient(const std::vector<AReal> &x, const Real *gradient) {
+    std::vector<ADEdge> &naryEdges = g_ADGraph->naryEdges;
+    for (size_t i = 0; i < x.size(); i++) {
+        if (gradient[i] != Real(0.0)) {
+            naryEdges.push_back(ADEdge(x[i].varId, gradient[i]));
+        }
+    }
+}
+
+// y = f(x) for a function evaluated by the caller (e.g. a special function or an ODE step), 
+// with the value val, the gradient gradient[i] = df/dx[i] and the row-major Hessian 
+// hessian[i * n + j] = d^2f/dx[i]dx[j] (only j <= i is read), recorded as a single vertex.
+// The graph cannot be replayed afterwards.
+inline AReal ExternalFunction(const std::vector<AReal> &x, const Real val, 
+                              const Real *gradient, const Real *hessian) {
+    ADGraph &graph = *g_ADGraph;
+    const size_t n = x.size();
+    const VertexId edgeBegin = graph.naryEdges.size(), soBegin = graph.narySoEdges.size();
+    AddNaryGradient(x, gradient);
+    AddNarySoEdges(x, [&](const size_t i, const size_t j) {
+        return hessian[i * n + j];
+    });
+    AReal ret = NewAReal(val);
+    SetNaryVertex(ret, edgeBegin, soBegin);
+    return ret;
+}
+
+// Same with the sparse Hessian hessian, each pair (row, col) of indices of x given once
+inline AReal ExternalFunction(const std::vector<AReal> &x, const Real val, 
+                              const Real *gradient, const std::vector<HessianEntry> &hessian) {
+    ADGraph &graph = *g_ADGraph;
+    const VertexId edgeBegin = graph.naryEdges.size(), soBegin = graph.narySoEdges.size();
+    AddNaryGradient(x, gradient);
+    for (size_t k = 0; k < hessian.size(); k++) {
+        AddNarySoEdge(x, hessian[k].row, hessian[k].col, hessian[k].val);
+    }
+    AReal ret = NewAReal(val);
+    SetNaryVertex(ret, edgeBegin, soBegin);
+    return ret;
+}
+///////////////////////////////////////////////////////////
+
+inline void SetAdjoint(const AReal &v, const Real adj) {
+    g_ADGraph->vertices[v.varId].w = adj;
+}
+
+inline Real GetAdjoint(const AReal &v) {
+    return g_ADGraph->vertices[v.varId].w;
+}
+
+inline Real GetAdjoint(const AReal &i, const AReal &j) {
+    if (i.varId == j.varId) {
+        return g_ADGraph->selfSoEdges[i.varId];
+    } else {
+        return g_ADGraph->soEdges[std::max(i.varId, j.varId)].Query(std::min(i.varId, j.varId));
+    }
+}
+
+// Same as above on the given graph instead of the current one
+inline void SetAdjoint(ADGraph &graph, const AReal &v, const Real adj) {
+    graph.vertices[v.varId].w = adj;
+}
+
+inline Real GetAdjoint(const ADGraph &graph, const AReal &v) {
+    return graph.vertices[v.varId].w;
+}
+
+inline Real GetAdjoint(const ADGraph &graph, const AReal &i, const AReal &j) {
+    if (i.varId == j.varId) {
+        return graph.selfSoEdges[i.varId];
+    } else {
+        return graph.soEdges[std::max(i.varId, j.varId)].Query(std::min(i.varId, j.varId));
+    }
+}
+
+// Value of v, which is updated by Replay()
+inline Real GetValue(const AReal &v) {
+    if (g_ADGraph->recordOps) {
+        return g_ADGraph->ops[v.varId].val;
+    }
+    return v.val;
+}
+
+// Same as above on the graph of the bound variables (see ABoundReal)
+inline void SetAdjoint(const ABoundReal &v, const Real adj) {
+    SetAdjoint(*v.graph, v.var, adj);
+}
+
+inline Real GetAdjoint(const ABoundReal &v) {
+    return GetAdjoint(*v.graph, v.var);
+}
+
+inline Real GetAdjoint(const ABoundReal &i, const ABoundReal &j) {
+    return GetAdjoint(*i.graph, i.var, j.var);
+}
+
+inline Real GetValue(const ABoundReal &v) {
+    if (v.graph->recordOps) {
+        return v.graph->ops[v.var.varId].val;
+    }
+    return v.var.val;
+}
+
+// Recompute the values and the edge weights of a graph recorded with recordOps 
+// at new inputs, without allocating any memory. 
+// The inputs are assigned to the first leaf vertices in the order they were created, 
+// the other leaves (e.g. AReal f = 0.0 after the independent variables, or any leaf 
+// created after the first operation) are constants which keep their values.
+// The adjoints are reset, so SetAdjoint() & PropagateAdjoint() can be called again. 
+// Returns false without changing the graph if there are more inputs than leaves before 
+// the first operation or the graph has n-ary vertices (added by AddNaryEdges()). 
+// Also returns false if a recorded comparison gives a different result at the new inputs 
+// (the control flow depends on the inputs), the graph is then evaluated at the new inputs 
+// but the function has to be recorded again. 
+inline bool Replay(const std::vector<Real> &inputs) {
+    std::vector<ADVertex> &vertices = g_ADGraph->vertices;
+    std::vector<ADOp> &ops = g_ADGraph->ops;
+    size_t numInputs = 0;
+    for (VertexId vid = 0; vid < (VertexId)ops.size(); vid++) {
+        if (ops[vid].code == OP_NARY) {
+            return false;
+        }
+        numInputs += ops[vid].code == OP_INPUT;
+    }
+    if (numInputs < inputs.size()) {
+        return false;
+    }
+    size_t inputId = 0;
+    for (VertexId vid = 0; vid < (VertexId)ops.size(); vid++) {
+        ADOp &op = ops[vid];
+        ADVertex &vertex = vertices[vid];
+        switch (op.code) {
+            case OP_INPUT: {
+                if (inputId < inputs.size()) {
+                    op.val = inputs[inputId++];
+                }
+                break;
+            }
+            case OP_CONST:
+            case OP_NARY: {
+                break;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL: {
+                Real dfx, dfy, ddf;
+                EvalBinary(op.code, ops[op.a].val, ops[op.b].val, 
+                           op.val, dfx, dfy, ddf);
+                vertex.e1.w = Weight(dfx);
+                vertex.e2.w = Weight(dfy);
+                vertex.soW = Weight(ddf);
+                break;
+            }
+            default: {
+                Real df, ddf;
+                EvalUnary(op.code, ops[op.a].val, op.c, op.val, df, ddf);
+                vertex.e1.w = Weight(df);
+                vertex.soW = Weight(ddf);
+                break;
+            }
+        }
+        vertex.w = Real(0.0);
+    }
+
+    std::vector<ADGuard> &guards = g_ADGraph->guards;
+    for (int i = 0; i < (int)guards.size(); i++) {
+        const ADGuard &guard = guards[i];
+        if (Compare(guard.code, ops[guard.l].val, ops[guard.r].val) != guard.result) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline VertexId SingleEdgePropagate(VertexId x, Real &a) {
+    bool cont = g_ADGraph->vertices[x].e1.to != x &&
+                g_ADGraph->vertices[x].e2.to == x;
+    while (cont) {
+        a *= g_ADGraph->vertices[x].e1.w;
+        x = g_ADGraph->vertices[x].e1.to;
+        cont = g_ADGraph->vertices[x].e1.to != x &&
+               g_ADGraph->vertices[x].e2.to == x;
+    }
+    return x;
+}
+
+inline void PushEdge(const ADEdge &foEdge, const ADEdge &soEdge) {
+    g_ADGraph->soEdgesTracked = false;
+    if (foEdge.to == soEdge.to) {
+        g_ADGraph->selfSoEdges[foEdge.to] += Real(2.0) * foEdge.w * soEdge.w;
+    } else {
+        g_ADGraph->soEdges[std::max(foEdge.to, soEdge.to)].Insert(
+            std::min(foEdge.to, soEdge.to), foEdge.w * soEdge.w);
+    }
+}
+
+// Remove the second-order adjoints of the previous propagation
+// The nodes are dropped and the arena is rewound, so the next sweep reuses its chunks.
+// If the last sweep tracked them, only the vertices of touchedSoEdges are reset.
+inline void ResetSoEdges() {
+    ADGraph &graph = *g_ADGraph;
+    std::vector<SoEdgeStore> &soEdges = graph.soEdges;
+    std::vector<Real> &selfSoEdges = graph.selfSoEdges;
+    graph.arena.Drop();
+    if (graph.soEdgesTracked) {
+        // Clear() & PruneGraph() may have shrunk the storage since the sweep
+        for (size_t i = 0; i < graph.touchedSoEdges.size(); i++) {
+            const VertexId v = graph.touchedSoEdges[i];
+            if (v < soEdges.size()) {
+                soEdges[v].Release();
+            }
+            if (v < selfSoEdges.size()) {
+                selfSoEdges[v] = Real(0.0);
+            }
+        }
+        selfSoEdges.resize(graph.vertices.size(), Real(0.0));
+    } else {
+        for (size_t i = 0; i < soEdges.size(); i++) {
+            soEdges[i].Release();
+        }
+        selfSoEdges.assign(graph.vertices.size(), Real(0.0));
+    }
+    graph.touchedSoEdges.clear();
+    graph.soEdgesTracked = false;
+    graph.arena.Reset();
+    if (graph.vertices.size() > soEdges.size()) {
+        soEdges.resize(graph.vertices.size(), SoEdgeStore(&graph.arena));
+    }
+}
+
+inline bool IsZero(const Real x) {
+    return x == Real(0.0);
+}
+
+// The storage of the adjoints used by the sweep, Adjoints::W, Self & So return the adjoint, 
+// the second-order self edge and the second-order edges of a vertex.
+// GraphAdjoints uses the ones of the graph, VectorAdjoint stores vectors of adjoints.
+struct GraphAdjoints {
+    typedef Real Value;
+    typedef SoEdgeStore Store;
+
+    GraphAdjoints(ADGraph &graph) : graph(graph) {}
+
+    inline Real& W(const VertexId v) {
+        return graph.vertices[v].w;
+    }
+    inline Real& Self(const VertexId v) {
+        return graph.selfSoEdges[v];
+    }
+    inline Store& So(const VertexId v) {
+        return graph.soEdges[v];
+    }
+#ifdef USE_STATS
+    inline ADStats& Stats() {
+        return graph.stats;
+    }
+#endif
+
+    ADGraph &graph;
+};
+
+// Record the vertices whose second-order adjoints are nonzero during the sweep, 
+// only for the adjoints of the graph itself (see ResetSoEdges())
+template <typename Adjoints>
+inline void TouchSoEdges(Adjoints &, const VertexId) {}
+
+inline void TouchSoEdges(GraphAdjoints &adjoints, const VertexId v) {
+    ADGraph &graph = adjoints.graph;
+    if (!graph.soEdges[v].nodes.empty() || graph.selfSoEdges[v] != Real(0.0)) {
+        graph.touchedSoEdges.push_back(v);
+    }
+}
+
+// Add the second-order weight val between i and j, which counts twice if i == j
+template <typename Adjoints, typename T>
+inline void AddSoEdge(Adjoints &adjoints, const VertexId i, const VertexId j, const T &val) {
+    if (i == j) {
+        adjoints.Self(i) += val * Real(2.0);
+    } else {
+        const bool created = adjoints.So(std::max(i, j)).Insert(std::min(i, j), val);
+        HAD_STATS(created ? adjoints.Stats().insertNodes++ : adjoints.Stats().insertHits++);
+        (void)created;
+    }
+}
+
+// Push the second-order edge (to, child of foEdge) with weight val through foEdge
+template <typename Adjoints, typename T>
+inline void PushEdge(Adjoints &adjoints, const ADEdge &foEdge, const VertexId to, const T &val) {
+    HAD_STATS(adjoints.Stats().pushEdgeCalls++);
+    AddSoEdge(adjoints, foEdge.to, to, val * foEdge.w);
+}
+
+template <typename Adjoints>
+inline void SweepNaryVertex(Adjoints &adjoints, const VertexId vid, const ADNaryVertex &nary, 
+                            const ADEdge *naryEdges, const ADSoEdge *narySoEdges, const bool streaming) {
+    typedef typename Adjoints::Value T;
+    typedef typename Adjoints::Store Store;
+    const ADEdge *edges = naryEdges + nary.edgeBegin;
+    const int numEdges = nary.edgeEnd - nary.edgeBegin;
+
+    // Pushing
+    Store &store = adjoints.So(vid);
+    for (int i = 0; i < (int)store.nodes.size(); i++) {
+        for (int j = 0; j < numEdges; j++) {
+            PushEdge(adjoints, edges[j], store.nodes[i].key, store.nodes[i].val);
+        }
+    }
+    const T self = adjoints.Self(vid);
+    if (!IsZero(self)) {
+        for (int i = 0; i < numEdges; i++) {
+            adjoints.Self(edges[i].to) += self * (edges[i].w * edges[i].w);
+            for (int j = 0; j < i; j++) {
+                AddSoEdge(adjoints, edges[i].to, edges[j].to, self * (edges[i].w * edges[j].w));
+            }
+        }
+    }
+
+    if (streaming) {
+        store.Release();
+        adjoints.Self(vid) = T();
+    }
+
+    const T a = adjoints.W(vid);
+    if (!IsZero(a)) {
+        // Creating
+        for (VertexId i = nary.soBegin; i < nary.soEnd; i++) {
+            const ADSoEdge &soEdge = narySoEdges[i];
+            if (soEdge.to1 == soEdge.to2) {
+                adjoints.Self(soEdge.to1) += a * soEdge.w;
+            } else {
+                AddSoEdge(adjoints, soEdge.to1, soEdge.to2, a * soEdge.w);
+            }
+        }
+        // Adjoint
+        adjoints.W(vid) = T();
+        for (int i = 0; i < numEdges; i++) {
+            adjoints.W(edges[i].to) += a * edges[i].w;
+        }
+    }
+}
+
+// The reverse sweep of the edge_pushing algorithm, the second-order adjoints already 
+// in the storage are pushed together with the ones created on the way
+template <typename Adjoints>
+inline void SweepAdjoint(ADGraph &graph, Adjoints &adjoints) {
+    typedef typename Adjoints::Value T;
+    typedef typename Adjoints::Store Store;
+    // Any chance for SSE/AVX parallism?
+    HAD_STATS(adjoints.Stats().Reset());
+
+    for (VertexId vid = graph.vertices.size() - 1; vid > 0; vid--) {
+        const ADVertex &vertex = graph.vertices[vid];
+        const ADEdge &e1 = vertex.e1;
+        const ADEdge &e2 = vertex.e2;
+        // the edges of vid are complete, only its parents are updated from now on
+        TouchSoEdges(adjoints, vid);
+        if (e1.to == vid) {
+            HAD_STATS(adjoints.Stats().leavesSkipped++);
+            continue;
+        }
+        HAD_STATS(adjoints.Stats().verticesVisited++);
+        HAD_STATS(adjoints.Stats().AddVertex(adjoints.So(vid), !IsZero(adjoints.Self(vid))));
+        if (IsNary(vertex)) {
+            SweepNaryVertex(adjoints, vid, graph.naryVertices[NaryIndex(vertex)], 
+                            graph.naryEdges.data(), graph.narySoEdges.data(), graph.streaming);
+            continue;
+        }
+
+        // Pushing
+        Store &store = adjoints.So(vid);
+        if (e2.to == vid) {
+            for (int i = 0; i < (int)store.nodes.size(); i++) {
+                PushEdge(adjoints, e1, store.nodes[i].key, store.nodes[i].val);
+            }
+        } else {
+            for (int i = 0; i < (int)store.nodes.size(); i++) {
+                PushEdge(adjoints, e1, store.nodes[i].key, store.nodes[i].val);
+                PushEdge(adjoints, e2, store.nodes[i].key, store.nodes[i].val);
+            }
+        }
+        const T self = adjoints.Self(vid);
+        if (!IsZero(self)) {
+            adjoints.Self(e1.to) += self * (e1.w * e1.w);
+            if (e2.to != vid) {
+                adjoints.Self(e2.to) += self * (e2.w * e2.w);
+                AddSoEdge(adjoints, e1.to, e2.to, self * (e1.w * e2.w));
+            }
+        }
+
+        if (graph.streaming) {
+            store.Release();
+            adjoints.Self(vid) = T();
+        }
+
+        const T a = adjoints.W(vid);
+        if (!IsZero(a)) {
+            // Creating
+            if (vertex.soW != Real(0.0)) {
+                if (e2.to == vid) { // single-edge
+                    adjoints.Self(e1.to) += a * vertex.soW;
+                } else {
+                    AddSoEdge(adjoints, e1.to, e2.to, a * vertex.soW);
+                }
+            }
+            // Adjoint
+            adjoints.W(vid) = T();
+            adjoints.W(e1.to) += a * e1.w;
+            if (e2.to != vid) {
+                adjoints.W(e2.to) += a * e2.w;
+            }
+        }
+    }
+    if (!graph.vertices.empty()) {
+        TouchSoEdges(adjoints, 0);
+    }
+#ifdef USE_STATS
+    // the edges of the leaves are complete after the sweep
+    for (VertexId vid = 0; vid < graph.vertices.size(); vid++) {
+        if (graph.vertices[vid].e1.to == vid) {
+            adjoints.Stats().AddVertex(adjoints.So(vid), !IsZero(adjoints.Self(vid)));
+        }
+    }
+#endif
+}
+
+// The reverse sweep of PropagateAdjoint() on g_ADGraph
+inline void SweepAdjoint() {
+    GraphAdjoints adjoints(*g_ADGraph);
+    SweepAdjoint(*g_ADGraph, adjoints);
+    g_ADGraph->soEdgesTracked = true;
+}
+
+inline void PropagateAdjoint() {
+    ResetSoEdges();
+    SweepAdjoint();
+}
+
+// Propagate graph instead of the current graph, in any thread
+inline void PropagateAdjoint(ADGraph &graph) {
+    ADGraphScope scope(graph);
+    PropagateAdjoint();
+}
+
+// Remove all the first & second-order adjoints but keep the values & the weights of the graph, 
+// to propagate it again with other seeds
+inline void ResetDerivatives() {
+    std::vector<ADVertex> &vertices = g_ADGraph->vertices;
+    for (size_t i = 0; i < vertices.size(); i++) {
+        vertices[i].w = Real(0.0);
+    }
+    ResetSoEdges();
+}
+
+inline void ResetDerivatives(ADGraph &graph) {
+    ADGraphScope scope(graph);
+    ResetDerivatives();
+}
+
+// Propagate the first-order adjoints only (the gradient), without touching 
+// soEdges & selfSoEdges, GetAdjoint(i, j) is not available afterwards
+inline void PropagateAdjointFirstOrder() {
+    ADGraph &graph = *g_ADGraph;
+    ADVertex *vertices = graph.vertices.data();
+    for (VertexId vid = graph.vertices.size() - 1; vid > 0; vid--) {
+        ADVertex &vertex = vertices[vid];
+        const Real a = vertex.w;
+        if (a == Real(0.0) || vertex.e1.to == vid) {
+            continue;
+        }
+        vertex.w = Real(0.0);
+        if (IsNary(vertex)) {
+            const ADNaryVertex &nary = graph.naryVertices[NaryIndex(vertex)];
+            for (VertexId i = nary.edgeBegin; i < nary.edgeEnd; i++) {
+                vertices[graph.naryEdges[i].to].w += a * graph.naryEdges[i].w;
+            }
+            continue;
+        }
+        vertices[vertex.e1.to].w += a * vertex.e1.w;
+        if (vertex.e2.to != vid) {
+            vertices[vertex.e2.to].w += a * vertex.e2.w;
+        }
+    }
+}
+
+inline void PropagateAdjointFirstOrder(ADGraph &graph) {
+    ADGraphScope scope(graph);
+    PropagateAdjointFirstOrder();
+}
+
+// Id of the vertices removed by PruneGraph()
+const VertexId kPrunedVertex = VertexId(-1);
+
+// Remove the vertices that none of the seeded vertices (w != 0) depends on, except the leaves, 
+// and renumber the others in the same order, so that the sweeps only visit the live vertices.
+// newIds[id] is the new id of the vertex id, or kPrunedVertex if it was removed, 
+// the AReals recorded before have to be renumbered with Remap().
+// If ADGraph::recordOps is true, the operands of the comparisons are kept as well 
+// so that the graph can still be replayed.
+inline void PruneGraph(std::vector<VertexId> &newIds) {
+    ADGraph &graph = *g_ADGraph;
+    std::vector<ADVertex> &vertices = graph.vertices;
+    const VertexId n = vertices.size();
+    std::vector<char> live(n);
+    for (VertexId vid = 0; vid < n; vid++) {
+        live[vid] = vertices[vid].w != Real(0.0) || vertices[vid].e1.to == vid;
+    }
+    if (graph.recordOps) {
+        for (int i = 0; i < (int)graph.guards.size(); i++) {
+            live[graph.guards[i].l] = live[graph.guards[i].r] = 1;
+        }
+    }
+    // the parents of a vertex have smaller ids
+    for (VertexId vid = n; vid-- > 0;) {
+        const ADVertex &vertex = vertices[vid];
+        if (!live[vid] || vertex.e1.to == vid) {
+            continue;
+        }
+        if (IsNary(vertex)) {
+            const ADNaryVertex &nary = graph.naryVertices[NaryIndex(vertex)];
+            for (VertexId i = nary.edgeBegin; i < nary.edgeEnd; i++) {
+                live[graph.naryEdges[i].to] = 1;
+            }
+            // the second-order weights are kept when the edges of zero partials are dropped
+            for (VertexId i = nary.soBegin; i < nary.soEnd; i++) {
+                live[graph.narySoEdges[i].to1] = live[graph.narySoEdges[i].to2] = 1;
+            }
+        } else {
+            live[vertex.e1.to] = 1;
+            if (vertex.e2.to != vid) {
+                live[vertex.e2.to] = 1;
+            }
+        }
+    }
+
+    newIds.assign(n, kPrunedVertex);
+    VertexId numLive = 0;
+    for (VertexId vid = 0; vid < n; vid++) {
+        if (live[vid]) {
+            newIds[vid] = numLive++;
+        }
+    }
+    // the new ids are never larger than the old ones, so the vertices are moved in place
+    std::vector<ADNaryVertex> naryVertices;
+    std::vector<ADEdge> naryEdges;
+    std::vector<ADSoEdge> narySoEdges;
+    for (VertexId vid = 0; vid < n; vid++) {
+        if (!live[vid]) {
+            continue;
+        }
+        ADVertex vertex = vertices[vid];
+        const VertexId id = newIds[vid];
+        if (vertex.e1.to == vid) {
+            vertex.e1.to = vertex.e2.to = id;
+        } else if (IsNary(vertex)) {
+            const ADNaryVertex &nary = graph.naryVertices[NaryIndex(vertex)];
+            const VertexId edgeBegin = naryEdges.size(), soBegin = narySoEdges.size();
+            for (VertexId i = nary.edgeBegin; i < nary.edgeEnd; i++) {
+                naryEdges.push_back(ADEdge(newIds[graph.naryEdges[i].to], graph.naryEdges[i].w));
+            }
+            for (VertexId i = nary.soBegin; i < nary.soEnd; i++) {
+                const ADSoEdge &soEdge = graph.narySoEdges[i];
+                narySoEdges.push_back(ADSoEdge(newIds[soEdge.to1], newIds[soEdge.to2], soEdge.w));
+            }
+            vertex.e1.to = vertex.e2.to = kNaryFlag | (VertexId)naryVertices.size();
+            naryVertices.push_back(ADNaryVertex(edgeBegin, naryEdges.size(), 
+                                                soBegin, narySoEdges.size()));
+        } else {
+            vertex.e2.to = vertex.e2.to == vid ? id : newIds[vertex.e2.to];
+            vertex.e1.to = newIds[vertex.e1.to];
+        }
+        vertices[id] = vertex;
+        if (graph.recordOps) {
+            ADOp op = graph.ops[vid];
+            if (op.code != OP_INPUT && op.code != OP_CONST && op.code != OP_NARY) {
+                op.a = newIds[op.a];
+                op.b = newIds[op.b];
+            }
+            graph.ops[id] = op;
+        }
+    }
+    vertices.resize(numLive);
+    graph.naryVertices.swap(naryVertices);
+    graph.naryEdges.swap(naryEdges);
+    graph.narySoEdges.swap(narySoEdges);
+    if (graph.recordOps) {
+        graph.ops.resize(numLive);
+        for (int i = 0; i < (int)graph.guards.size(); i++) {
+            graph.guards[i].l = newIds[graph.guards[i].l];
+            graph.guards[i].r = newIds[graph.guards[i].r];
+        }
+    }
+    // the second-order adjoints of the old ids are meaningless
+    if (graph.soEdges.size() > numLive) {
+        graph.soEdges.resize(numLive);
+    }
+    graph.selfSoEdges.clear();
+}
+
+inline AReal Remap(const AReal &x, const std::vector<VertexId> &newIds) {
+    return AReal(x.val, newIds[x.varId]);
+}
+
+// Propagate a batch of independent outputs recorded in the same graph with a single sweep, 
+// each output is seeded with a unit adjoint. The outputs must not share any vertex 
+// (each has its own independent variables declared before its computation), 
+// then the derivatives of each output are the ones of its own variables.
+inline void PropagateAdjoint(const std::vector<AReal> &outputs) {
+    for (int i = 0; i < (int)outputs.size(); i++) {
+        g_ADGraph->vertices[outputs[i].varId].w += Real(1.0);
+    }
+    PropagateAdjoint();
+}
+
+// A pool of graphs that keep their memory between uses, so that recording and 
+// propagating many small functions does not allocate in steady state
+struct ADGraphPool {
+    ADGraphPool() {}
+    ADGraphPool(const ADGraphPool &) = delete;
+    ADGraphPool& operator=(const ADGraphPool &) = delete;
+
+    ~ADGraphPool() {
+        for (int i = 0; i < (int)graphs.size(); i++) {
+            delete graphs[i];
+        }
+    }
+
+    // Get a cleared graph and make it the current graph (g_ADGraph)
+    inline ADGraph* Acquire() {
+        ADGraph *graph;
+        if (freeGraphs.size() > 0) {
+            graph = freeGraphs.back();
+            freeGraphs.pop_back();
+            graph->Clear();
+            g_ADGraph = graph;
+        } else {
+            graph = new ADGraph();
+            graphs.push_back(graph);
+        }
+        return graph;
+    }
+
+    // Give a graph back to the pool, it must not be used anymore by the caller
+    inline void Release(ADGraph *graph) {
+        freeGraphs.push_back(graph);
+    }
+
+    std::vector<ADGraph*> graphs;
+    std::vector<ADGraph*> freeGraphs;
+};
+
+// A fixed-size vector of K adjoints, the loops are simple enough 
+// to be vectorized by the compiler
+template <int K>
+struct AdjointVec {
+    AdjointVec() {
+        for (int k = 0; k < K; k++) {
+            v[k] = Real(0.0);
+        }
+    }
+
+    inline AdjointVec& operator+=(const AdjointVec &a) {
+        for (int k = 0; k < K; k++) {
+            v[k] += a.v[k];
+        }
+        return *this;
+    }
+
+    inline AdjointVec operator*(const Real s) const {
+        AdjointVec ret;
+        for (int k = 0; k < K; k++) {
+            ret.v[k] = v[k] * s;
+        }
+        return ret;
+    }
+
+    inline bool IsZero() const {
+        bool zero = true;
+        for (int k = 0; k < K; k++) {
+            zero &= v[k] == Real(0.0);
+        }
+        return zero;
+    }
+
+    Real v[K];
+};
+
+// Vector-mode adjoints: K seeds (e.g. K outputs of the same function) are propagated 
+// through g_ADGraph with a single sweep, giving K gradients and K Hessians. 
+// The weights of the graph are shared by all the seeds, only the adjoints are vectors.
+template <int K>
+inline bool IsZero(const AdjointVec<K> &x) {
+    return x.IsZero();
+}
+
+template <int K>
+struct VectorAdjoint {
+    typedef AdjointVec<K> Value;
+    typedef AdjointVec<K> Vec;
+    typedef SoEdgeStoreT<Vec> Store;
+
+    // Remove all the adjoints
+    inline void Clear() {
+        w.assign(g_ADGraph->vertices.size(), Vec());
+    }
+
+    // Seed the k-th adjoint of v
+    inline void SetAdjoint(const AReal &v, const int k, const Real adj) {
+        if (w.size() < g_ADGraph->vertices.size()) {
+            w.resize(g_ADGraph->vertices.size());
+        }
+        w[v.varId].v[k] = adj;
+    }
+
+    inline Real GetAdjoint(const AReal &v, const int k) const {
+        return w[v.varId].v[k];
+    }
+
+    inline Real GetAdjoint(const AReal &i, const AReal &j, const int k) {
+        if (i.varId == j.varId) {
+            return selfSoEdges[i.varId].v[k];
+        } else {
+            return soEdges[std::max(i.varId, j.varId)].Query(std::min(i.varId, j.varId)).v[k];
+        }
+    }
+
+    inline Vec& W(const VertexId v) {
+        return w[v];
+    }
+    inline Vec& Self(const VertexId v) {
+        return selfSoEdges[v];
+    }
+    inline Store& So(const VertexId v) {
+        return soEdges[v];
+    }
+#ifdef USE_STATS
+    inline ADStats& Stats() {
+        return g_ADGraph->stats;
+    }
+#endif
+
+    // Same as the scalar PropagateAdjoint(), with the adjoints replaced by vectors
+    inline void PropagateAdjoint() {
+        const std::vector<ADVertex> &vertices = g_ADGraph->vertices;
+        for (size_t i = 0; i < soEdges.size(); i++) {
+            soEdges[i].Clear();
+        }
+        if (vertices.size() > soEdges.size()) {
+            soEdges.resize(vertices.size());
+        }
+        selfSoEdges.assign(vertices.size(), Vec());
+        w.resize(vertices.size());
+        SweepAdjoint(*g_ADGraph, *this);
+    }
+
+    std::vector<Vec> w;
+    std::vector<Vec> selfSoEdges;
+    std::vector<Store> soEdges;
+};
+
+// Pointers to the arrays of a structure-of-arrays tape (see ADTape & ADMappedTape)
+struct ADTapeView {
+    size_t numVertices;
+    const VertexId *to1, *to2;
+    const Weight *w1, *w2, *soW;
+    const ADNaryVertex *naryVertices;
+    const ADEdge *naryEdges;
+    const ADSoEdge *narySoEdges;
+};
+
+// Same as SweepAdjoint() on a structure-of-arrays tape, the targets of a vertex 
+// are read before its weights
+template <typename Adjoints>
+inline void SweepTape(const ADTapeView &tape, Adjoints &adjoints, const bool streaming) {
+    typedef typename Adjoints::Store Store;
+    HAD_STATS(adjoints.Stats().Reset());
+
+    for (VertexId vid = tape.numVertices - 1; vid > 0; vid--) {
+        const VertexId t1 = tape.to1[vid];
+        if (t1 == vid) {
+            HAD_STATS(adjoints.Stats().leavesSkipped++);
+            continue;
+        }
+        HAD_STATS(adjoints.Stats().verticesVisited++);
+        if (t1 & kNaryFlag) {
+            SweepNaryVertex(adjoints, vid, tape.naryVertices[t1 & ~kNaryFlag], 
+                            tape.naryEdges, tape.narySoEdges, streaming);
+            continue;
+        }
+        const VertexId t2 = tape.to2[vid];
+        const bool twoEdges = t2 != vid;
+        const ADEdge e1(t1, tape.w1[vid]);
+        const ADEdge e2(t2, tape.w2[vid]);
+
+        // Pushing
+        Store &store = adjoints.So(vid);
+        for (int i = 0; i < (int)store.nodes.size(); i++) {
+            PushEdge(adjoints, e1, store.nodes[i].key, store.nodes[i].val);
+            if (twoEdges) {
+                PushEdge(adjoints, e2, store.nodes[i].key, store.nodes[i].val);
+            }
+        }
+        const Real s = adjoints.Self(vid);
+        if (s != Real(0.0)) {
+            adjoints.Self(t1) += s * e1.w * e1.w;
+            if (twoEdges) {
+                adjoints.Self(t2) += s * e2.w * e2.w;
+                AddSoEdge(adjoints, t1, t2, s * e1.w * e2.w);
+            }
+        }
+
+        if (streaming) {
+            store.Release();
+            adjoints.Self(vid) = Real(0.0);
+        }
+
+        const Real a = adjoints.W(vid);
+        if (a != Real(0.0)) {
+            // Creating
+            const Real soW = tape.soW[vid];
+            if (soW != Real(0.0)) {
+                if (twoEdges) {
+                    AddSoEdge(adjoints, t1, t2, a * soW);
+                } else {
+                    adjoints.Self(t1) += a * soW;
+                }
+            }
+            // Adjoint
+            adjoints.W(vid) = Real(0.0);
+            adjoints.W(t1) += a * e1.w;
+            if (twoEdges) {
+                adjoints.W(t2) += a * e2.w;
+            }
+        }
+    }
+}
+
+// Structure-of-arrays copy of the edges of g_ADGraph, without the padding of ADEdge 
+// (40 bytes per vertex instead of 48 with the default VertexId, Weight & Real). The sweep only reads the targets 
+// of a vertex before touching its weights, so less memory is moved per vertex. 
+// The first-order adjoints are stored in the tape, the second-order adjoints 
+// in g_ADGraph as usual (GetAdjoint(i, j), GetHessian() etc. can be used after PropagateAdjoint()).
+// The tape has to be built again if the weights of the graph change (e.g. after Replay()).
+struct ADTape {
+    typedef Real Value;
+    typedef SoEdgeStore Store;
+
+    // Copy the edges and the adjoints of the current graph
+    inline void Build() {
+        const std::vector<ADVertex> &vertices = g_ADGraph->vertices;
+        const size_t n = vertices.size();
+        to1.resize(n);
+        to2.resize(n);
+        w1.resize(n);
+        w2.resize(n);
+        soW.resize(n);
+        w.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            to1[i] = vertices[i].e1.to;
+            to2[i] = vertices[i].e2.to;
+            w1[i] = vertices[i].e1.w;
+            w2[i] = vertices[i].e2.w;
+            soW[i] = vertices[i].soW;
+            w[i] = vertices[i].w;
+        }
+    }
+
+    inline void SetAdjoint(const AReal &v, const Real adj) {
+        w[v.varId] = adj;
+    }
+
+    inline Real GetAdjoint(const AReal &v) const {
+        return w[v.varId];
+    }
+
+    inline Real& W(const VertexId v) {
+        return w[v];
+    }
+    inline Real& Self(const VertexId v) {
+        return self[v];
+    }
+    inline Store& So(const VertexId v) {
+        return so[v];
+    }
+#ifdef USE_STATS
+    inline ADStats& Stats() {
+        return g_ADGraph->stats;
+    }
+#endif
+
+    // Same as SingleEdgePropagate() on the tape
+    inline VertexId SingleEdgePropagate(VertexId x, Real &a) const {
+        while (to1[x] != x && to2[x] == x) {
+            a *= w1[x];
+            x = to1[x];
+        }
+        return x;
+    }
+
+    inline ADTapeView View() const {
+        const ADGraph &graph = *g_ADGraph;
+        ADTapeView view;
+        view.numVertices = to1.size();
+        view.to1 = to1.data();
+        view.to2 = to2.data();
+        view.w1 = w1.data();
+        view.w2 = w2.data();
+        view.soW = soW.data();
+        view.naryVertices = graph.naryVertices.data();
+        view.naryEdges = graph.naryEdges.data();
+        view.narySoEdges = graph.narySoEdges.data();
+        return view;
+    }
+
+    // Same as PropagateAdjoint() on the tape
+    inline void PropagateAdjoint() {
+        ResetSoEdges();
+        self = g_ADGraph->selfSoEdges.data();
+        so = g_ADGraph->soEdges.data();
+        SweepTape(View(), *this, g_ADGraph->streaming);
+    }
+
+    std::vector<VertexId> to1, to2;
+    std::vector<Weight> w1, w2, soW;
+    std::vector<Real> w;
+    // the second-order adjoints of g_ADGraph during PropagateAdjoint()
+    Real *self;
+    Store *so;
+};
+
+#ifdef USE_TAPE_FILE
+// Tape file: an ADTapeFileHeader followed by the arrays to1, to2, w1, w2, soW, 
+// w (if hasAdjoints), naryVertices, naryEdges & narySoEdges, each starting at a multiple of 8 bytes.
+// The file is only readable on machines with the same endianness, Real, Weight & VertexId.
+struct ADTapeFileHeader {
+    char magic[4];
+    unsigned int version;
+    unsigned int realSize, idSize, weightSize, reserved;
+    unsigned long long numVertices;
+    unsigned long long numNaryVertices, numNaryEdges, numNarySoEdges;
+    unsigned long long hasAdjoints;
+};
+
+inline size_t AlignTapeOffset(const size_t offset) {
+    return (offset + 7) & ~size_t(7);
+}
+
+// Write the n values get(i) to file, padded to a multiple of 8 bytes
+template <typename T, typename F>
+inline bool WriteTapeArray(FILE *file, const size_t n, F get) {
+    const size_t bufferSize = 4096;
+    T buffer[bufferSize];
+    for (size_t i = 0; i < n; i += bufferSize) {
+        const size_t m = std::min(bufferSize, n - i);
+        for (size_t k = 0; k < m; k++) {
+            buffer[k] = get(i + k);
+        }
+        if (fwrite(buffer, sizeof(T), m, file) != m) {
+            return false;
+        }
+    }
+    const char padding[8] = {0};
+    const size_t bytes = n * sizeof(T);
+    return fwrite(padding, 1, AlignTapeOffset(bytes) - bytes, file) == AlignTapeOffset(bytes) - bytes;
+}
+
+// Write g_ADGraph to a tape file (see ADMappedTape), 
+// with the current first-order adjoints if adjoints is true
+inline bool SaveTape(const char *path, const bool adjoints = false) {
+    const ADGraph &graph = *g_ADGraph;
+    const std::vector<ADVertex> &v = graph.vertices;
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    ADTapeFileHeader header;
+    memcpy(header.magic, "HADT", 4);
+    header.version = 2;
+    header.realSize = sizeof(Real);
+    header.idSize = sizeof(VertexId);
+    header.weightSize = sizeof(Weight);
+    header.reserved = 0;
+    header.numVertices = v.size();
+    header.numNaryVertices = graph.naryVertices.size();
+    header.numNaryEdges = graph.naryEdges.size();
+    header.numNarySoEdges = graph.narySoEdges.size();
+    header.hasAdjoints = adjoints;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        WriteTapeArray<VertexId>(file, v.size(), [&](size_t i) { return v[i].e1.to; }) &&
+        WriteTapeArray<VertexId>(file, v.size(), [&](size_t i) { return v[i].e2.to; }) &&
+        WriteTapeArray<Weight>(file, v.size(), [&](size_t i) { return v[i].e1.w; }) &&
+        WriteTapeArray<Weight>(file, v.size(), [&](size_t i) { return v[i].e2.w; }) &&
+        WriteTapeArray<Weight>(file, v.size(), [&](size_t i) { return v[i].soW; }) &&
+        (!adjoints || WriteTapeArray<Real>(file, v.size(), [&](size_t i) { return v[i].w; })) &&
+        WriteTapeArray<ADNaryVertex>(file, graph.naryVertices.size(), 
+                                     [&](size_t i) { return graph.naryVertices[i]; }) &&
+        WriteTapeArray<ADEdge>(file, graph.naryEdges.size(), 
+                               [&](size_t i) { return graph.naryEdges[i]; }) &&
+        WriteTapeArray<ADSoEdge>(file, graph.narySoEdges.size(), 
+                                 [&](size_t i) { return graph.narySoEdges[i]; });
+    return fclose(file) == 0 && ok;
+}
+
+// A tape file mapped into memory (read into memory on Windows). PropagateAdjoint() sweeps 
+// backward through the mapped arrays, the pages already swept are clean and can be dropped 
+// by the system, so only the adjoints and the second-order edges have to fit into memory 
+// (set streaming to true to release the edges of the intermediate vertices). 
+// The vertex ids are the ones of the recorded graph.
+struct ADMappedTape {
+    typedef Real Value;
+    typedef SoEdgeStore Store;
+
+    ADMappedTape() : streaming(false), data(0), size(0) {}
+    ~ADMappedTape() {
+        Close();
+    }
+    ADMappedTape(const ADMappedTape&) = delete;
+    ADMappedTape& operator=(const ADMappedTape&) = delete;
+
+    // Returns false if the file cannot be read or was written with a different Real, Weight or VertexId
+    inline bool Open(const char *path) {
+        Close();
+#ifndef WIN32
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ADTapeFileHeader)) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void *mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        data = (const char*)mapped;
+#else
+        FILE *file = fopen(path, "rb");
+        if (!file) {
+            return false;
+        }
+        fseek(file, 0, SEEK_END);
+        buffer.resize(ftell(file));
+        fseek(file, 0, SEEK_SET);
+        bool read = fread(buffer.data(), 1, buffer.size(), file) == buffer.size();
+        fclose(file);
+        if (!read || buffer.size() < sizeof(ADTapeFileHeader)) {
+            return false;
+        }
+        data = buffer.data();
+        size = buffer.size();
+#endif
+        const ADTapeFileHeader &header = *(const ADTapeFileHeader*)data;
+        if (memcmp(header.magic, "HADT", 4) != 0 || header.version != 2 ||
+            header.realSize != sizeof(Real) || header.idSize != sizeof(VertexId) ||
+            header.weightSize != sizeof(Weight)) {
+            Close();
+            return false;
+        }
+        const size_t n = header.numVertices;
+        size_t offset = AlignTapeOffset(sizeof(ADTapeFileHeader));
+        view.numVertices = n;
+        view.to1 = (const VertexId*)Array(offset, n * sizeof(VertexId));
+        view.to2 = (const VertexId*)Array(offset, n * sizeof(VertexId));
+        view.w1 = (const Weight*)Array(offset, n * sizeof(Weight));
+        view.w2 = (const Weight*)Array(offset, n * sizeof(Weight));
+        view.soW = (const Weight*)Array(offset, n * sizeof(Weight));
+        const Real *adjoints = header.hasAdjoints ? (const Real*)Array(offset, n * sizeof(Real)) : 0;
+        view.naryVertices = (const ADNaryVertex*)Array(offset, header.numNaryVertices * sizeof(ADNaryVertex));
+        view.naryEdges = (const ADEdge*)Array(offset, header.numNaryEdges * sizeof(ADEdge));
+        view.narySoEdges = (const ADSoEdge*)Array(offset, header.numNarySoEdges * sizeof(ADSoEdge));
+        if (offset > size) {
+            Close();
+            return false;
+        }
+        if (adjoints) {
+            w.assign(adjoints, adjoints + n);
+        } else {
+            w.assign(n, Real(0.0));
+        }
+        return true;
+    }
+
+    inline void Close() {
+#ifndef WIN32
+        if (data) {
+            munmap((void*)data, size);
+        }
+#else
+        std::vector<char>().swap(buffer);
+#endif
+        data = 0;
+        size = 0;
+    }
+
+    inline void SetAdjoint(const VertexId v, const Real adj) {
+        w[v] = adj;
+    }
+
+    inline Real GetAdjoint(const VertexId v) const {
+        return w[v];
+    }
+
+    inline Real GetAdjoint(const VertexId i, const VertexId j) {
+        if (i == j) {
+            return selfSoEdges[i];
+        } else {
+            return soEdges[std::max(i, j)].Query(std::min(i, j));
+        }
+    }
+
+    inline Real& W(const VertexId v) {
+        return w[v];
+    }
+    inline Real& Self(const VertexId v) {
+        return selfSoEdges[v];
+    }
+    inline Store& So(const VertexId v) {
+        return soEdges[v];
+    }
+#ifdef USE_STATS
+    inline ADStats& Stats() {
+        return stats;
+    }
+#endif
+
+    inline void PropagateAdjoint() {
+        for (size_t i = 0; i < soEdges.size(); i++) {
+            soEdges[i].Clear();
+        }
+        soEdges.resize(view.numVertices);
+        selfSoEdges.assign(view.numVertices, Real(0.0));
+        SweepTape(view, *this, streaming);
+    }
+
+    // Pointer to the array of the given bytes at offset, offset is moved to the next array
+    inline const char* Array(size_t &offset, const size_t bytes) const {
+        const char *ptr = data + offset;
+        offset = AlignTapeOffset(offset + bytes);
+        return ptr;
+    }
+
+    bool streaming;
+    ADTapeView view;
+    std::vector<Real> w;
+    std::vector<Real> selfSoEdges;
+    std::vector<Store> soEdges;
+#ifdef USE_STATS
+    ADStats stats;
+#endif
+    const char *data;
+    size_t size;
+#ifdef WIN32
+    std::vector<char> buffer;
+#endif
+};
+#endif
+
+
+// Calls f(i, j, d^2f/dvars[i]dvars[j]) once for every pair of variables connected by 
+// a second-order edge (including i == j), walking the edges of each variable only once
+template <typename F>
+inline void GatherHessian(const std::vector<AReal> &vars, F f) {
+    VertexId maxId = 0;
+    for (int i = 0; i < (int)vars.size(); i++) {
+        maxId = std::max(maxId, vars[i].varId);
+    }
+    std::vector<int> index(maxId + 1, -1);
+    for (int i = 0; i < (int)vars.size(); i++) {
+        index[vars[i].varId] = i;
+    }
+    for (int i = 0; i < (int)vars.size(); i++) {
+        VertexId vid = vars[i].varId;
+        if (index[vid] != i) { // duplicated variable
+            continue;
+        }
+        if (g_ADGraph->selfSoEdges[vid] != Real(0.0)) {
+            f(i, i, g_ADGraph->selfSoEdges[vid]);
+        }
+        const SoEdgeStore::Nodes &nodes = g_ADGraph->soEdges[vid].nodes;
+        for (int k = 0; k < (int)nodes.size(); k++) {
+            // keys are always smaller than vid
+            int j = index[nodes[k].key];
+            if (j >= 0) {
+                f(i, j, nodes[k].val);
+            }
+        }
+    }
+}
+
+enum HessianLayout {
+    // the whole symmetric matrix
+    HESSIAN_FULL,
+    // only the lower triangle (row >= col), the upper triangle is left as zeros
+    HESSIAN_LOWER
+};
+
+// Write the Hessian with respect to vars into the row-major n x n matrix out
+inline void GetHessian(const std::vector<AReal> &vars, Real *out, 
+                       const HessianLayout layout = HESSIAN_FULL) {
+    const size_t n = vars.size();
+    std::fill(out, out + n * n, Real(0.0));
+    GatherHessian(vars, [&](const int i, const int j, const Real val) {
+        size_t row = std::max(i, j), col = std::min(i, j);
+        out[row * n + col] = val;
+        if (layout == HESSIAN_FULL) {
+            out[col * n + row] = val;
+        }
+    });
+}
+
+// The lower triangle (row >= col) of the Hessian with respect to vars in coordinate format
+inline void GetHessianCOO(const std::vector<AReal> &vars, std::vector<HessianEntry> &entries) {
+    entries.clear();
+    GatherHessian(vars, [&](const int i, const int j, const Real val) {
+        entries.push_back(HessianEntry(std::max(i, j), std::min(i, j), val));
+    });
+}
+
+// The lower triangle (row >= col) of the Hessian with respect to vars in compressed sparse row format,
+// the columns of each row are sorted
+inline void GetHessianCSR(const std::vector<AReal> &vars, std::vector<int> &rowPtr,
+                          std::vector<int> &cols, std::vector<Real> &vals) {
+    std::vector<HessianEntry> entries;
+    GetHessianCOO(vars, entries);
+    const int n = (int)vars.size();
+    rowPtr.assign(n + 1, 0);
+    for (int k = 0; k < (int)entries.size(); k++) {
+        rowPtr[entries[k].row + 1]++;
+    }
+    for (int i = 0; i < n; i++) {
+        rowPtr[i + 1] += rowPtr[i];
+    }
+    std::vector<std::pair<int, Real> > rowEntries(entries.size());
+    std::vector<int> offset(rowPtr.begin(), rowPtr.end() - 1);
+    for (int k = 0; k < (int)entries.size(); k++) {
+        rowEntries[offset[entries[k].row]++] = std::make_pair(entries[k].col, entries[k].val);
+    }
+    cols.resize(entries.size());
+    vals.resize(entries.size());
+    for (int i = 0; i < n; i++) {
+        std::sort(rowEntries.begin() + rowPtr[i], rowEntries.begin() + rowPtr[i + 1]);
+        for (int k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+            cols[k] = rowEntries[k].first;
+            vals[k] = rowEntries[k].second;
+        }
+    }
+}
+
+// out = H * v, where H is the Hessian with respect to vars
+inline void HessianVectorProduct(const std::vector<AReal> &vars, const Real *v, Real *out) {
+    std::fill(out, out + vars.size(), Real(0.0));
+    GatherHessian(vars, [&](const int i, const int j, const Real val) {
+        out[i] += val * v[j];
+        if (i != j) {
+            out[j] += val * v[i];
+        }
+    });
+}
+
+// out = H * v without the second-order edges (forward-over-reverse): a tangent sweep along v 
+// followed by a reverse sweep of the adjoints and of their tangents, using the weights of 
+// the vertices only, in O(number of vertices) time & memory. The seeds are the adjoints 
+// set with SetAdjoint() (not PropagateAdjoint()), they are left unchanged. 
+// numVectors products are computed at once if v & out hold numVectors vectors 
+// of vars.size() values one after another.
+inline void PropagateHessianVectorProduct(const std::vector<AReal> &vars, const Real *v, Real *out, 
+                                          const int numVectors = 1) {
+    const ADGraph &graph = *g_ADGraph;
+    const std::vector<ADVertex> &vertices = graph.vertices;
+    const VertexId n = vertices.size();
+    const size_t m = numVectors, numVars = vars.size();
+    std::vector<Real> tangents(n * m, Real(0.0)), adjoints(n), adjointTangents(n * m, Real(0.0));
+    for (size_t i = 0; i < numVars; i++) {
+        for (size_t k = 0; k < m; k++) {
+            tangents[vars[i].varId * m + k] = v[k * numVars + i];
+        }
+    }
+    // the parents of a vertex have smaller ids
+    for (VertexId vid = 0; vid < n; vid++) {
+        const ADVertex &vertex = vertices[vid];
+        if (vertex.e1.to == vid) {
+            continue;
+        }
+        Real *t = &tangents[vid * m];
+        if (IsNary(vertex)) {
+            const ADNaryVertex &nary = graph.naryVertices[NaryIndex(vertex)];
+            for (VertexId e = nary.edgeBegin; e < nary.edgeEnd; e++) {
+                const ADEdge &edge = graph.naryEdges[e];
+                const Real *tp = &tangents[edge.to * m];
+                for (size_t k = 0; k < m; k++) {
+                    t[k] += edge.w * tp[k];
+                }
+            }
+            continue;
+        }
+        const Real *t1 = &tangents[vertex.e1.to * m];
+        for (size_t k = 0; k < m; k++) {
+            t[k] += vertex.e1.w * t1[k];
+        }
+        if (vertex.e2.to != vid) {
+            const Real *t2 = &tangents[vertex.e2.to * m];
+            for (size_t k = 0; k < m; k++) {
+                t[k] += vertex.e2.w * t2[k];
+            }
+        }
+    }
+
+    for (VertexId vid = 0; vid < n; vid++) {
+        adjoints[vid] = vertices[vid].w;
+    }
+    for (VertexId vid = n; vid-- > 0;) {
+        const ADVertex &vertex = vertices[vid];
+        if (vertex.e1.to == vid) {
+            continue;
+        }
+        const Real a = adjoints[vid];
+        const Real *at = &adjointTangents[vid * m];
+        if (IsNary(vertex)) {
+            const ADNaryVertex &nary = graph.naryVertices[NaryIndex(vertex)];
+            for (VertexId e = nary.edgeBegin; e < nary.edgeEnd; e++) {
+                const ADEdge &edge = graph.naryEdges[e];
+                adjoints[edge.to] += a * edge.w;
+                Real *atp = &adjointTangents[edge.to * m];
+                for (size_t k = 0; k < m; k++) {
+                    atp[k] += edge.w * at[k];
+                }
+            }
+            if (a != Real(0.0)) {
+                for (VertexId e = nary.soBegin; e < nary.soEnd; e++) {
+                    const ADSoEdge &soEdge = graph.narySoEdges[e];
+                    const Real aw = a * soEdge.w;
+                    Real *at1 = &adjointTangents[soEdge.to1 * m];
+                    const Real *t2 = &tangents[soEdge.to2 * m];
+                    for (size_t k = 0; k < m; k++) {
+                        at1[k] += aw * t2[k];
+                    }
+                    if (soEdge.to1 != soEdge.to2) {
+                        Real *at2 = &adjointTangents[soEdge.to2 * m];
+                        const Real *t1 = &tangents[soEdge.to1 * m];
+                        for (size_t k = 0; k < m; k++) {
+                            at2[k] += aw * t1[k];
+                        }
+                    }
+                }
+            }
+            continue;
+        }
+        const ADEdge &e1 = vertex.e1, &e2 = vertex.e2;
+        const Real aw = a * vertex.soW;
+        Real *at1 = &adjointTangents[e1.to * m];
+        adjoints[e1.to] += a * e1.w;
+        if (e2.to == vid) {
+            // d^2f/dx^2 = soW
+            const Real *t1 = &tangents[e1.to * m];
+            for (size_t k = 0; k < m; k++) {
+                at1[k] += e1.w * at[k] + aw * t1[k];
+            }
+        } else {
+            // d^2f/dxdy = soW
+            adjoints[e2.to] += a * e2.w;
+            Real *at2 = &adjointTangents[e2.to * m];
+            const Real *t1 = &tangents[e1.to * m], *t2 = &tangents[e2.to * m];
+            for (size_t k = 0; k < m; k++) {
+                at1[k] += e1.w * at[k] + aw * t2[k];
+                at2[k] += e2.w * at[k] + aw * t1[k];
+            }
+        }
+    }
+    for (size_t i = 0; i < numVars; i++) {
+        for (size_t k = 0; k < m; k++) {
+            out[k * numVars + i] = adjointTangents[vars[i].varId * m + k];
+        }
+    }
+}
+
+// Declare the independent variables vars of value x, e.g. the parameters shared by the graphs 
+// of different nodes. They have to be the first vertices of the graph, false if it is not empty.
+inline bool DeclareVariables(const std::vector<Real> &x, std::vector<AReal> &vars) {
+    if (!g_ADGraph->vertices.empty()) {
+        return false;
+    }
+    vars.resize(x.size());
+    for (size_t i = 0; i < x.size(); i++) {
+        vars[i] = AReal(x[i]);
+    }
+    return true;
+}
+
+// Wire format of a HessianAccumulator: an ADHessianWireHeader followed by the arrays 
+// gradient[n], rows[numEntries], cols[numEntries] (unsigned int) & vals[numEntries] 
+// of the lower triangle of the Hessian. The messages are only readable on machines 
+// with the same endianness & Real.
+struct ADHessianWireHeader {
+    char magic[4];
+    unsigned int version;
+    unsigned int realSize, reserved;
+    unsigned long long n, numEntries;
+};
+
+template <typename T>
+inline void WriteWireArray(std::vector<unsigned char> &buffer, const T *values, const size_t n) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(values);
+    buffer.insert(buffer.end(), bytes, bytes + n * sizeof(T));
+}
+
+template <typename T>
+inline const unsigned char *ReadWireArray(const unsigned char *data, T *values, const size_t n) {
+    std::copy(data, data + n * sizeof(T), reinterpret_cast<unsigned char *>(values));
+    return data + n * sizeof(T);
+}
+
+// Gradient and sparse Hessian with respect to n variables, 
+// accumulated over several propagations (e.g. from different graphs)
+struct HessianAccumulator {
+    inline void Reset(const int n) {
+        gradient.assign(n, Real(0.0));
+        for (int i = 0; i < (int)rows.size(); i++) {
+            rows[i].Clear();
+        }
+        rows.resize(n);
+    }
+
+    // Add the derivatives with respect to vars of the last propagation 
+    inline void Accumulate(const std::vector<AReal> &vars) {
+        for (int i = 0; i < (int)vars.size(); i++) {
+            gradient[i] += GetAdjoint(vars[i]);
+        }
+        GatherHessian(vars, [&](const int i, const int j, const Real val) {
+            rows[std::max(i, j)].Insert(std::min(i, j), val);
+        });
+    }
+
+    inline void Merge(const HessianAccumulator &other) {
+        for (int i = 0; i < (int)gradient.size(); i++) {
+            gradient[i] += other.gradient[i];
+            const SoEdgeStore::Nodes &nodes = other.rows[i].nodes;
+            for (int k = 0; k < (int)nodes.size(); k++) {
+                rows[i].Insert(nodes[k].key, nodes[k].val);
+            }
+        }
+    }
+
+    inline Real GetHessian(const int i, const int j) {
+        return rows[std::max(i, j)].Query(std::min(i, j));
+    }
+
+    // Append the derivatives to buffer in the wire format (see ADHessianWireHeader), 
+    // to send them to the other nodes with any transport
+    inline void Serialize(std::vector<unsigned char> &buffer) const {
+        std::vector<unsigned int> r, c;
+        std::vector<Real> vals;
+        for (int i = 0; i < (int)rows.size(); i++) {
+            const SoEdgeStore::Nodes &nodes = rows[i].nodes;
+            for (int k = 0; k < (int)nodes.size(); k++) {
+                r.push_back(i);
+                c.push_back((unsigned int)nodes[k].key);
+                vals.push_back(nodes[k].val);
+            }
+        }
+        ADHessianWireHeader header;
+        std::copy("HADH", "HADH" + 4, header.magic);
+        header.version = 1;
+        header.realSize = sizeof(Real);
+        header.reserved = 0;
+        header.n = gradient.size();
+        header.numEntries = vals.size();
+        WriteWireArray(buffer, &header, 1);
+        WriteWireArray(buffer, gradient.data(), gradient.size());
+        WriteWireArray(buffer, r.data(), r.size());
+        WriteWireArray(buffer, c.data(), c.size());
+        WriteWireArray(buffer, vals.data(), vals.size());
+    }
+
+    // Add the derivatives serialized by another accumulator of n variables (e.g. received 
+    // from another node), false without any change if data is not such a message
+    inline bool Merge(const unsigned char *data, const size_t size) {
+        ADHessianWireHeader header;
+        if (size < sizeof(header)) {
+            return false;
+        }
+        data = ReadWireArray(data, &header, 1);
+        const unsigned long long n = header.n, m = header.numEntries;
+        if (!std::equal(header.magic, header.magic + 4, "HADH") || header.version != 1 || 
+            header.realSize != sizeof(Real) || n != gradient.size() || 
+            n > (size - sizeof(header)) / sizeof(Real)) {
+            return false;
+        }
+        // divided rather than multiplied, so that a forged count cannot wrap around
+        const size_t entryBytes = 2 * sizeof(unsigned int) + sizeof(Real);
+        const size_t entriesBytes = size - sizeof(header) - n * sizeof(Real);
+        if (entriesBytes % entryBytes != 0 || m != entriesBytes / entryBytes) {
+            return false;
+        }
+        std::vector<Real> g(n), vals(m);
+        std::vector<unsigned int> r(m), c(m);
+        data = ReadWireArray(data, g.data(), n);
+        data = ReadWireArray(data, r.data(), m);
+        data = ReadWireArray(data, c.data(), m);
+        ReadWireArray(data, vals.data(), m);
+        for (size_t k = 0; k < m; k++) {
+            if (r[k] >= n || c[k] > r[k]) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            gradient[i] += g[i];
+        }
+        for (size_t k = 0; k < m; k++) {
+            rows[r[k]].Insert(c[k], vals[k]);
+        }
+        return true;
+    }
+
+    std::vector<Real> gradient;
+    // row i stores the entries (i, j) for j <= i
+    std::vector<SoEdgeStore> rows;
+};
+
+// Second-order sparsity pattern of g_ADGraph, for graphs of the same shape propagated many times 
+// (e.g. by Replay() or by recording the same function at different points).
+// Analyze() runs a symbolic sweep that gives every second-order edge a slot, 
+// then PropagateAdjoint() accumulates into the precomputed slots without any search, 
+// insertion or allocation. The pattern only depends on the edges of the graph and on which 
+// second-order weights are zero (e.g. those of the additions), so it stays valid as long as Matches() is true. 
+// The adjoints are read from and written to the graph as usual, 
+// the second-order adjoints are only available from the pattern (ADGraph::streaming is ignored).
+struct ADPattern {
+    // Build the pattern of the current graph
+    inline void Analyze() {
+        const ADGraph &graph = *g_ADGraph;
+        numVertices = graph.vertices.size();
+        numSlots = 0;
+        shape = Shape();
+        targets.clear();
+        keys.clear();
+        begin.assign(numVertices, 0);
+        count.assign(numVertices, 0);
+        flags.assign(numVertices, 0);
+        // slot of the second-order edge (i, max(i, j)) + 1 in the order of creation
+        std::vector<SoEdgeStoreT<size_t> > stores(numVertices);
+        std::vector<size_t> position;
+        std::vector<bool> self(numVertices, false), visited(numVertices, false);
+
+        for (VertexId vid = numVertices - 1; vid > 0; vid--) {
+            const ADVertex &vertex = graph.vertices[vid];
+            if (vertex.e1.to == vid) {
+                continue;
+            }
+            visited[vid] = true;
+            // the edges of vid are complete, give them consecutive positions
+            AddVertex(vid, stores[vid], position);
+            const ADEdge *edges = &vertex.e1;
+            int numEdges = vertex.e2.to == vid ? 1 : 2;
+            const ADNaryVertex *nary = 0;
+            if (IsNary(vertex)) {
+                nary = &graph.naryVertices[NaryIndex(vertex)];
+                edges = graph.naryEdges.data() + nary->edgeBegin;
+                numEdges = nary->edgeEnd - nary->edgeBegin;
+            }
+            // Pushing
+            const SoEdgeStoreT<size_t>::Nodes &nodes = stores[vid].nodes;
+            for (int k = 0; k < (int)nodes.size(); k++) {
+                for (int e = 0; e < numEdges; e++) {
+                    targets.push_back(Target(stores, self, edges[e].to, nodes[k].key));
+                }
+            }
+            if (self[vid]) {
+                flags[vid] |= kPushSelf;
+                for (int i = 0; i < numEdges; i++) {
+                    self[edges[i].to] = true;
+                    for (int j = 0; j < i; j++) {
+                        targets.push_back(Target(stores, self, edges[i].to, edges[j].to));
+                    }
+                }
+            }
+            // Creating
+            if (nary) {
+                for (VertexId i = nary->soBegin; i < nary->soEnd; i++) {
+                    const ADSoEdge &soEdge = graph.narySoEdges[i];
+                    self[soEdge.to1] = self[soEdge.to1] || soEdge.to1 == soEdge.to2;
+                    if (soEdge.to1 != soEdge.to2) {
+                        targets.push_back(Target(stores, self, soEdge.to1, soEdge.to2));
+                    }
+                }
+            } else if (vertex.soW != Real(0.0)) {
+                flags[vid] |= kCreate;
+                if (numEdges == 2) {
+                    targets.push_back(Target(stores, self, vertex.e1.to, vertex.e2.to));
+                } else {
+                    self[vertex.e1.to] = true;
+                }
+            }
+        }
+        for (VertexId vid = 0; vid < numVertices; vid++) {
+            if (!visited[vid]) {
+                AddVertex(vid, stores[vid], position);
+            }
+        }
+        for (size_t t = 0; t < targets.size(); t++) {
+            if (targets[t] >= numVertices) {
+                targets[t] = numVertices + position[targets[t] - numVertices];
+            }
+        }
+        vals.assign(numVertices + keys.size(), Real(0.0));
+    }
+
+    // True if the pattern can be used for the current graph
+    inline bool Matches() const {
+        return g_ADGraph->vertices.size() == numVertices && Shape() == shape;
+    }
+
+    // Same as PropagateAdjoint() for a graph matching the pattern
+    inline void PropagateAdjoint() {
+        ADGraph &graph = *g_ADGraph;
+        std::fill(vals.begin(), vals.end(), Real(0.0));
+        Real *self = vals.data();
+        const Real *so = vals.data() + numVertices;
+        const size_t *target = targets.data();
+
+        for (VertexId vid = numVertices - 1; vid > 0; vid--) {
+            ADVertex &vertex = graph.vertices[vid];
+            if (vertex.e1.to == vid) {
+                continue;
+            }
+            const ADEdge *edges = &vertex.e1;
+            int numEdges = vertex.e2.to == vid ? 1 : 2;
+            const ADNaryVertex *nary = 0;
+            if (IsNary(vertex)) {
+                nary = &graph.naryVertices[NaryIndex(vertex)];
+                edges = graph.naryEdges.data() + nary->edgeBegin;
+                numEdges = nary->edgeEnd - nary->edgeBegin;
+            }
+            // Pushing
+            for (size_t k = begin[vid]; k < begin[vid] + count[vid]; k++) {
+                const Real val = so[k];
+                for (int e = 0; e < numEdges; e++) {
+                    Accumulate(*target++, val * edges[e].w);
+                }
+            }
+            if (flags[vid] & kPushSelf) {
+                const Real s = self[vid];
+                for (int i = 0; i < numEdges; i++) {
+                    self[edges[i].to] += s * edges[i].w * edges[i].w;
+                    for (int j = 0; j < i; j++) {
+                        Accumulate(*target++, s * edges[i].w * edges[j].w);
+                    }
+                }
+            }
+            const Real a = vertex.w;
+            // Creating
+            if (nary) {
+                for (VertexId i = nary->soBegin; i < nary->soEnd; i++) {
+                    const ADSoEdge &soEdge = graph.narySoEdges[i];
+                    if (soEdge.to1 == soEdge.to2) {
+                        self[soEdge.to1] += a * soEdge.w;
+                    } else {
+                        Accumulate(*target++, a * soEdge.w);
+                    }
+                }
+            } else if (flags[vid] & kCreate) {
+                if (numEdges == 2) {
+                    Accumulate(*target++, a * vertex.soW);
+                } else {
+                    self[vertex.e1.to] += a * vertex.soW;
+                }
+            }
+            // Adjoint
+            if (a != Real(0.0)) {
+                vertex.w = Real(0.0);
+                for (int e = 0; e < numEdges; e++) {
+                    graph.vertices[edges[e].to].w += a * edges[e].w;
+                }
+            }
+        }
+    }
+
+    inline Real GetAdjoint(const AReal &i, const AReal &j) const {
+        if (i.varId == j.varId) {
+            return vals[i.varId];
+        }
+        const VertexId vid = std::max(i.varId, j.varId), key = std::min(i.varId, j.varId);
+        for (size_t k = begin[vid]; k < begin[vid] + count[vid]; k++) {
+            if (keys[k] == key) {
+                return vals[numVertices + k];
+            }
+        }
+        return Real(0.0);
+    }
+
+    // Same as GetHessianCOO() for the last propagation
+    inline void GetHessianCOO(const std::vector<AReal> &vars, std::vector<HessianEntry> &entries) const {
+        entries.clear();
+        VertexId maxId = 0;
+        for (int i = 0; i < (int)vars.size(); i++) {
+            maxId = std::max(maxId, vars[i].varId);
+        }
+        std::vector<int> index(maxId + 1, -1);
+        for (int i = 0; i < (int)vars.size(); i++) {
+            index[vars[i].varId] = i;
+        }
+        for (int i = 0; i < (int)vars.size(); i++) {
+            const VertexId vid = vars[i].varId;
+            if (index[vid] != i) { // duplicated variable
+                continue;
+            }
+            if (vals[vid] != Real(0.0)) {
+                entries.push_back(HessianEntry(i, i, vals[vid]));
+            }
+            for (size_t k = begin[vid]; k < begin[vid] + count[vid]; k++) {
+                const int j = index[keys[k]];
+                if (j >= 0 && vals[numVertices + k] != Real(0.0)) {
+                    entries.push_back(HessianEntry(std::max(i, j), std::min(i, j), vals[numVertices + k]));
+                }
+            }
+        }
+    }
+
+    inline void Accumulate(const size_t target, const Real val) {
+        // the self edges count twice
+        vals[target] += target < numVertices ? Real(2.0) * val : val;
+    }
+
+    // Index of the second-order edge (i, j) during Analyze(): i if i == j, 
+    // otherwise numVertices + the order of creation of the edge
+    inline size_t Target(std::vector<SoEdgeStoreT<size_t> > &stores, std::vector<bool> &self,
+                               const VertexId i, const VertexId j) {
+        if (i == j) {
+            self[i] = true;
+            return i;
+        }
+        SoEdgeStoreT<size_t> &store = stores[std::max(i, j)];
+        size_t slot = store.Query(std::min(i, j));
+        if (slot == 0) {
+            slot = ++numSlots;
+            store.Insert(std::min(i, j), slot);
+        }
+        return numVertices + slot - 1;
+    }
+
+    inline void AddVertex(const VertexId vid, SoEdgeStoreT<size_t> &store, 
+                          std::vector<size_t> &position) {
+        begin[vid] = keys.size();
+        count[vid] = store.nodes.size();
+        position.resize(numSlots);
+        for (int k = 0; k < (int)store.nodes.size(); k++) {
+            position[store.nodes[k].val - 1] = keys.size();
+            keys.push_back(store.nodes[k].key);
+        }
+    }
+
+    // Hash of the edges of the graph and of the vertices with nonzero second-order weights
+    inline unsigned long long Shape() const {
+        const ADGraph &graph = *g_ADGraph;
+        unsigned long long h = 14695981039346656037ull;
+        for (VertexId vid = 0; vid < graph.vertices.size(); vid++) {
+            const ADVertex &vertex = graph.vertices[vid];
+            h = (h ^ vertex.e1.to) * 1099511628211ull;
+            h = (h ^ vertex.e2.to) * 1099511628211ull;
+            h = (h ^ (vertex.soW != Real(0.0))) * 1099511628211ull;
+        }
+        for (size_t i = 0; i < graph.naryEdges.size(); i++) {
+            h = (h ^ graph.naryEdges[i].to) * 1099511628211ull;
+        }
+        for (size_t i = 0; i < graph.narySoEdges.size(); i++) {
+            h = (h ^ graph.narySoEdges[i].to1) * 1099511628211ull;
+            h = (h ^ graph.narySoEdges[i].to2) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    VertexId numVertices;
+    size_t numSlots;
+    unsigned long long shape;
+    // the second-order edges of vertex v are the slots [begin[v], begin[v] + count[v]), 
+    // whose keys are the other vertices of the edges
+    std::vector<size_t> begin, count;
+    std::vector<VertexId> keys;
+    // slots written by the sweep, in the order they are written
+    std::vector<size_t> targets;
+    // kPushSelf if the self edge of a vertex is nonzero, kCreate if its second-order weight is nonzero
+    enum { kPushSelf = 1, kCreate = 2 };
+    std::vector<unsigned char> flags;
+    // the self edges of the vertices followed by the slots
+    std::vector<Real> vals;
+};
+
+// Records the state after a segment (out) from the state before it (in)
+typedef std::function<void(const std::vector<AReal> &in, std::vector<AReal> &out)> ADSegment;
+
+// Checkpointed differentiation of a function composed of segments x_{k+1} = f_k(x_k).
+// Only the input state of each segment is kept, the segments are recorded 
+// into g_ADGraph one at a time and recorded again in reverse order by PropagateAdjoint(), 
+// where the adjoints and the second-order edges of the outputs of a segment 
+// (the frontier) are carried over from the following segment.
+// All the variables the function depends on have to be part of the state.
+struct ADCheckpointer {
+    // Start from the independent variables x_0
+    inline void Begin(const std::vector<Real> &x) {
+        segments.clear();
+        checkpoints.assign(1, x);
+        ResetFrontier();
+    }
+
+    // Append a segment and evaluate it at the current state
+    inline void AddSegment(const ADSegment &segment) {
+        std::vector<AReal> in, out;
+        Record(segment, checkpoints.back(), in, out);
+        std::vector<Real> x(out.size());
+        for (int i = 0; i < (int)out.size(); i++) {
+            x[i] = out[i].val;
+        }
+        g_ADGraph->Clear();
+        segments.push_back(segment);
+        checkpoints.push_back(x);
+        ResetFrontier();
+    }
+
+    // The current state, i.e. the output of the last segment
+    inline const std::vector<Real>& GetState() const {
+        return checkpoints.back();
+    }
+
+    // Seed the adjoint of the i-th variable of the current state
+    inline void SetAdjoint(const int i, const Real adj) {
+        adjoint[i] = adj;
+    }
+
+    // After this, adjoint & hessian are the gradient and the lower triangle of the 
+    // Hessian with respect to x_0
+    inline void PropagateAdjoint() {
+        std::vector<AReal> in, out;
+        for (int k = (int)segments.size() - 1; k >= 0; k--) {
+            g_ADGraph->Clear();
+            Record(segments[k], checkpoints[k], in, out);
+            ResetSoEdges();
+
+            std::vector<ADVertex> &vertices = g_ADGraph->vertices;
+            for (int i = 0; i < (int)out.size(); i++) {
+                vertices[out[i].varId].w += adjoint[i];
+            }
+            for (int i = 0; i < (int)hessian.size(); i++) {
+                const HessianEntry &entry = hessian[i];
+                VertexId r = out[entry.row].varId;
+                VertexId c = out[entry.col].varId;
+                if (r == c) { 
+                    g_ADGraph->selfSoEdges[r] += 
+                        entry.row == entry.col ? entry.val : Real(2.0) * entry.val;
+                } else {
+                    g_ADGraph->soEdges[std::max(r, c)].Insert(std::min(r, c), entry.val);
+                }
+            }
+
+            SweepAdjoint();
+
+            adjoint.resize(in.size());
+            for (int i = 0; i < (int)in.size(); i++) {
+                adjoint[i] = vertices[in[i].varId].w;
+            }
+            GetHessianCOO(in, hessian);
+        }
+        g_ADGraph->Clear();
+    }
+
+    // Second derivative with respect to x_0[i] & x_0[j] after PropagateAdjoint()
+    inline Real GetHessian(const int i, const int j) const {
+        int row = std::max(i, j), col = std::min(i, j);
+        for (int k = 0; k < (int)hessian.size(); k++) {
+            if (hessian[k].row == row && hessian[k].col == col) {
+                return hessian[k].val;
+            }
+        }
+        return Real(0.0);
+    }
+
+    inline void Record(const ADSegment &segment, const std::vector<Real> &x,
+                       std::vector<AReal> &in, std::vector<AReal> &out) {
+        in.resize(x.size());
+        for (int i = 0; i < (int)x.size(); i++) {
+            in[i] = AReal(x[i]);
+        }
+        out.clear();
+        segment(in, out);
+    }
+
+    inline void ResetFrontier() {
+        adjoint.assign(checkpoints.back().size(), Real(0.0));
+        hessian.clear();
+    }
+
+    std::vector<ADSegment> segments;
+    // the input state of each segment, the last one is the current state
+    std::vector<std::vector<Real> > checkpoints;
+    // adjoints & second-order edges (row >= col) of the current frontier 
+    std::vector<Real> adjoint;
+    std::vector<HessianEntry> hessian;
+};
+
+#ifdef USE_THREADS
+// The k-th term of a function f(x) = sum_k term(x, k)
+typedef std::function<AReal(const std::vector<AReal> &x, int k)> ADTerm;
+
+// Gradient and Hessian of f(x) = sum_k term(x, k), k in [0, numTerms), using numThreads threads.
+// The terms are split into independent blocks of blockSize terms. Each thread records its 
+// blocks into its own ADGraph (g_ADGraph is thread-local), propagates them and accumulates 
+// the derivatives, the per-thread results are merged at the end.
+// term is called concurrently from different threads.
+inline void ParallelPropagateAdjoint(const std::vector<Real> &x, const int numTerms, const ADTerm &term,
+                                     HessianAccumulator &result, int numThreads = 0, 
+                                     const int blockSize = 256) {
+    if (numThreads <= 0) {
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    std::vector<HessianAccumulator> partials(numThreads);
+    std::atomic<int> nextBlock(0);
+    auto worker = [&](const int t) {
+        ADGraph graph;
+        HessianAccumulator &partial = partials[t];
+        partial.Reset((int)x.size());
+        std::vector<AReal> vars(x.size());
+        for (int begin = nextBlock++ * blockSize; begin < numTerms; begin = nextBlock++ * blockSize) {
+            graph.Clear();
+            for (int i = 0; i < (int)x.size(); i++) {
+                vars[i] = AReal(x[i]);
+            }
+            int end = std::min(begin + blockSize, numTerms);
+            for (int k = begin; k < end; k++) {
+                AReal y = term(vars, k);
+                graph.vertices[y.varId].w += Real(1.0);
+            }
+            PropagateAdjoint();
+            partial.Accumulate(vars);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++) {
+        threads.push_back(std::thread(worker, t));
+    }
+    ADGraph *graph = g_ADGraph;
+    worker(0);
+    g_ADGraph = graph;
+    for (int t = 0; t < (int)threads.size(); t++) {
+        threads[t].join();
+    }
+
+    result.Reset((int)x.size());
+    for (int t = 0; t < numThreads; t++) {
+        result.Merge(partials[t]);
+    }
+}
+
+// The vertices of g_ADGraph grouped by level for a data-parallel reverse sweep: the level of 
+// a vertex is above the ones of all its children, so the adjoints of a level can be computed 
+// concurrently, each vertex pulling the adjoints of its children (without atomics). 
+// The children & weights are copied, the schedule has to be built again when the graph changes 
+// (including the weights after Replay()).
+// Edge pushing only needs the children of a vertex to be swept before it, so the second-order 
+// sweep can follow the levels as well if the pair (i, j) is kept by whichever of i & j is swept 
+// first (the lower rank) instead of by max(i, j).
+struct ADLevelSchedule {
+    inline void Build() {
+        const ADGraph &graph = *g_ADGraph;
+        const VertexId n = graph.vertices.size();
+        level.assign(n, 0);
+        childBegin.assign(n + 1, 0);
+        VertexId numLevels = 1;
+        for (VertexId vid = n; vid-- > 0;) {
+            ForEachParent(graph, vid, [&](const ADEdge &e) {
+                childBegin[e.to + 1]++;
+                level[e.to] = std::max(level[e.to], level[vid] + 1);
+                numLevels = std::max(numLevels, level[e.to] + 1);
+            });
+        }
+        for (VertexId v = 0; v < n; v++) {
+            childBegin[v + 1] += childBegin[v];
+        }
+        children.resize(childBegin[n]);
+        weights.resize(childBegin[n]);
+        std::vector<VertexId> cursor(childBegin.begin(), childBegin.end() - 1);
+        for (VertexId vid = 0; vid < n; vid++) {
+            ForEachParent(graph, vid, [&](const ADEdge &e) {
+                children[cursor[e.to]] = vid;
+                weights[cursor[e.to]++] = e.w;
+            });
+        }
+        levelBegin.assign(numLevels + 1, 0);
+        for (VertexId v = 0; v < n; v++) {
+            levelBegin[level[v] + 1]++;
+        }
+        for (VertexId l = 0; l < numLevels; l++) {
+            levelBegin[l + 1] += levelBegin[l];
+        }
+        order.resize(n);
+        rank.resize(n);
+        cursor.assign(levelBegin.begin(), levelBegin.end() - 1);
+        for (VertexId v = 0; v < n; v++) {
+            // the leaves are never swept, they come after all the other vertices
+            rank[v] = graph.vertices[v].e1.to == v ? n + v : cursor[level[v]];
+            order[cursor[level[v]]++] = v;
+        }
+    }
+
+    // The edges to the parents of vid, none for a leaf
+    static inline const ADEdge *Parents(const ADGraph &graph, const VertexId vid, int &numEdges) {
+        const ADVertex &v = graph.vertices[vid];
+        if (v.e1.to == vid) {
+            numEdges = 0;
+            return 0;
+        }
+        if (IsNary(v)) {
+            const ADNaryVertex &nary = graph.naryVertices[NaryIndex(v)];
+            numEdges = int(nary.edgeEnd - nary.edgeBegin);
+            return graph.naryEdges.data() + nary.edgeBegin;
+        }
+        numEdges = v.e2.to == vid ? 1 : 2;
+        return &v.e1;
+    }
+
+    template <typename F>
+    static inline void ForEachParent(const ADGraph &graph, const VertexId vid, F f) {
+        int numEdges;
+        const ADEdge *edges = Parents(graph, vid, numEdges);
+        for (int i = 0; i < numEdges; i++) {
+            f(edges[i]);
+        }
+    }
+
+    // the vertices of level l are order[levelBegin[l]], ..., order[levelBegin[l + 1] - 1]
+    std::vector<VertexId> levelBegin, order;
+    // the level of each vertex, and its position in the sweep (after all the others for a leaf)
+    std::vector<VertexId> level, rank;
+    // the edges from the children of v are children[childBegin[v]], ... with weights
+    std::vector<VertexId> childBegin, children;
+    std::vector<Real> weights;
+};
+
+// Barrier of a fixed number of threads spinning on a generation counter
+struct ADSpinBarrier {
+    ADSpinBarrier(const int numThreads) : numThreads(numThreads), arrived(0), generation(0) {}
+
+    inline void Wait() {
+        const int g = generation.load();
+        if (arrived.fetch_add(1) + 1 == numThreads) {
+            arrived = 0;
+            generation++;
+        } else {
+            while (generation.load() == g) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    const int numThreads;
+    std::atomic<int> arrived, generation;
+};
+
+// Call worker(t) on numThreads threads (the calling thread being thread 0)
+template <typename F>
+inline void RunThreads(const int numThreads, F worker) {
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++) {
+        threads.push_back(std::thread(worker, t));
+    }
+    worker(0);
+    for (int t = 0; t < (int)threads.size(); t++) {
+        threads[t].join();
+    }
+}
+
+// The vertices [begin, end) of schedule.order swept by thread t in level l, 
+// all of them by thread 0 if the level has less than minLevelSize vertices. 
+// Returns false for such a small level.
+inline bool LevelRange(const ADLevelSchedule &schedule, const VertexId l, const int t, 
+                       const int numThreads, const int minLevelSize, VertexId &begin, VertexId &end) {
+    begin = schedule.levelBegin[l];
+    end = schedule.levelBegin[l + 1];
+    if (end - begin < (VertexId)minLevelSize) {
+        if (t != 0) {
+            begin = end;
+        }
+        return false;
+    }
+    const VertexId size = end - begin;
+    end = begin + size * (t + 1) / numThreads;
+    begin += size * t / numThreads;
+    return true;
+}
+
+// The adjoint of v from the ones of its children
+inline Real PullAdjoint(const ADLevelSchedule &schedule, const ADVertex *vertices, const VertexId v) {
+    Real a = vertices[v].w;
+    for (VertexId k = schedule.childBegin[v]; k < schedule.childBegin[v + 1]; k++) {
+        a += vertices[schedule.children[k]].w * schedule.weights[k];
+    }
+    return a;
+}
+
+// the adjoints of the intermediate vertices are consumed, as in the serial sweep
+inline void ConsumeAdjoints(ADVertex *vertices, const VertexId n, const int t, const int numThreads) {
+    for (VertexId v = n * t / numThreads; v < n * (t + 1) / numThreads; v++) {
+        if (vertices[v].e1.to != v) {
+            vertices[v].w = Real(0.0);
+        }
+    }
+}
+
+// Same as PropagateAdjointFirstOrder() with numThreads threads sweeping the levels of schedule 
+// (built on the current graph) one after another. The levels with less than minLevelSize 
+// vertices are swept by the calling thread alone.
+inline void PropagateAdjointFirstOrder(const ADLevelSchedule &schedule, int numThreads = 0, 
+                                       const int minLevelSize = 1024) {
+    if (numThreads <= 0) {
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    ADVertex *vertices = g_ADGraph->vertices.data();
+    const VertexId n = g_ADGraph->vertices.size();
+    const VertexId numLevels = schedule.levelBegin.size() - 1;
+    ADSpinBarrier barrier(numThreads);
+    RunThreads(numThreads, [&](const int t) {
+        // the vertices of level 0 have no children
+        for (VertexId l = 1; l < numLevels; l++) {
+            VertexId begin, end;
+            LevelRange(schedule, l, t, numThreads, minLevelSize, begin, end);
+            for (VertexId i = begin; i < end; i++) {
+                const VertexId v = schedule.order[i];
+                vertices[v].w = PullAdjoint(schedule, vertices, v);
+            }
+            barrier.Wait();
+        }
+        ConsumeAdjoints(vertices, n, t, numThreads);
+    });
+}
+
+// A second-order adjoint of the level-scheduled sweep, kept by owner (the self edge if key == owner)
+struct ADLevelSoEdge {
+    ADLevelSoEdge() {}
+    ADLevelSoEdge(const VertexId owner, const VertexId key, const Real w) : owner(owner), key(key), w(w) {}
+
+    VertexId owner, key;
+    Real w;
+};
+
+// Same as PropagateAdjoint() with numThreads threads sweeping the levels of schedule 
+// (built on the current graph) one after another, GetAdjoint(i, j) is available afterwards 
+// for the leaves i & j. Within a level the vertices only update the adjoints of higher levels, 
+// each thread buffers them by the thread that owns their target and the buffers are merged 
+// after the level (in the order of the threads). The levels with less than minLevelSize 
+// vertices are swept by the calling thread alone, without buffering.
+inline void PropagateAdjoint(const ADLevelSchedule &schedule, int numThreads = 0, 
+                             const int minLevelSize = 1024) {
+    if (numThreads <= 0) {
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    ResetSoEdges();
+    ADGraph &graph = *g_ADGraph;
+    ADVertex *vertices = graph.vertices.data();
+    const VertexId n = graph.vertices.size();
+    const VertexId numLevels = schedule.levelBegin.size() - 1;
+    const std::vector<VertexId> &rank = schedule.rank;
+    // the pair (i, j) is stored by the one with the lower rank
+    std::vector<SoEdgeStore> stores(n);
+    std::vector<Real> self(n, Real(0.0));
+    // buffers[t][u] are the adjoints added by thread t for the owners merged by thread u
+    std::vector<std::vector<std::vector<ADLevelSoEdge> > > buffers(numThreads, 
+        std::vector<std::vector<ADLevelSoEdge> >(numThreads));
+    auto apply = [&](const ADLevelSoEdge &e) {
+        if (e.owner == e.key) {
+            self[e.owner] += e.w;
+        } else {
+            stores[e.owner].Insert(e.key, e.w);
+        }
+    };
+    ADSpinBarrier barrier(numThreads);
+
+    RunThreads(numThreads, [&](const int t) {
+        bool buffered = false;
+        auto add = [&](const ADLevelSoEdge &e) {
+            if (buffered) {
+                buffers[t][e.owner % numThreads].push_back(e);
+            } else {
+                apply(e);
+            }
+        };
+        // same as AddSoEdge(), counts twice if i == j
+        auto addSoEdge = [&](const VertexId i, const VertexId j, const Real w) {
+            if (i == j) {
+                add(ADLevelSoEdge(i, i, Real(2.0) * w));
+            } else if (rank[i] < rank[j]) {
+                add(ADLevelSoEdge(i, j, w));
+            } else {
+                add(ADLevelSoEdge(j, i, w));
+            }
+        };
+        for (VertexId l = 0; l < numLevels; l++) {
+            VertexId begin, end;
+            buffered = LevelRange(schedule, l, t, numThreads, minLevelSize, begin, end);
+            for (VertexId i = begin; i < end; i++) {
+                const VertexId v = schedule.order[i];
+                const Real a = PullAdjoint(schedule, vertices, v);
+                vertices[v].w = a;
+                int numEdges;
+                const ADEdge *edges = ADLevelSchedule::Parents(graph, v, numEdges);
+                if (numEdges == 0) {
+                    continue;
+                }
+                // Pushing, a partner in the same level is pushed at the same time
+                const SoEdgeStore::Nodes &nodes = stores[v].nodes;
+                for (size_t k = 0; k < nodes.size(); k++) {
+                    const VertexId u = nodes[k].key;
+                    const Real w = nodes[k].val;
+                    int numUEdges = 0;
+                    const ADEdge *uEdges = 0;
+                    if (rank[u] < n && schedule.level[u] == l) {
+                        uEdges = ADLevelSchedule::Parents(graph, u, numUEdges);
+                    }
+                    for (int e = 0; e < numEdges; e++) {
+                        if (uEdges == 0) {
+                            addSoEdge(edges[e].to, u, w * edges[e].w);
+                        }
+                        for (int f = 0; f < numUEdges; f++) {
+                            addSoEdge(edges[e].to, uEdges[f].to, w * edges[e].w * uEdges[f].w);
+                        }
+                    }
+                }
+                stores[v].Release();
+                const Real s = self[v];
+                if (s != Real(0.0)) {
+                    for (int e = 0; e < numEdges; e++) {
+                        add(ADLevelSoEdge(edges[e].to, edges[e].to, s * edges[e].w * edges[e].w));
+                        for (int f = 0; f < e; f++) {
+                            addSoEdge(edges[e].to, edges[f].to, s * edges[e].w * edges[f].w);
+                        }
+                    }
+                }
+                if (a == Real(0.0)) {
+                    continue;
+                }
+                // Creating
+                const ADVertex &vertex = vertices[v];
+                if (IsNary(vertex)) {
+                    const ADNaryVertex &nary = graph.naryVertices[NaryIndex(vertex)];
+                    for (VertexId k = nary.soBegin; k < nary.soEnd; k++) {
+                        const ADSoEdge &soEdge = graph.narySoEdges[k];
+                        if (soEdge.to1 == soEdge.to2) {
+                            add(ADLevelSoEdge(soEdge.to1, soEdge.to1, a * soEdge.w));
+                        } else {
+                            addSoEdge(soEdge.to1, soEdge.to2, a * soEdge.w);
+                        }
+                    }
+                } else if (vertex.soW != Real(0.0)) {
+                    if (numEdges == 1) {
+                        add(ADLevelSoEdge(vertex.e1.to, vertex.e1.to, a * vertex.soW));
+                    } else {
+                        addSoEdge(vertex.e1.to, vertex.e2.to, a * vertex.soW);
+                    }
+                }
+            }
+            if (buffered) {
+                barrier.Wait();
+                for (int u = 0; u < numThreads; u++) {
+                    std::vector<ADLevelSoEdge> &buffer = buffers[u][t];
+                    for (size_t k = 0; k < buffer.size(); k++) {
+                        apply(buffer[k]);
+                    }
+                    buffer.clear();
+                }
+            }
+            barrier.Wait();
+        }
+        ConsumeAdjoints(vertices, n, t, numThreads);
+    });
+
+    // the pairs of leaves are kept by the smaller id, the graph keeps them by the larger one
+    for (VertexId v = 0; v < n; v++) {
+        if (rank[v] < n) {
+            continue;
+        }
+        graph.selfSoEdges[v] = self[v];
+        const SoEdgeStore::Nodes &nodes = stores[v].nodes;
+        for (size_t k = 0; k < nodes.size(); k++) {
+            graph.soEdges[nodes[k].key].Insert(v, nodes[k].val);
+        }
+    }
+}
+
+// Called by the worker of an ADPipeline with the propagated graph
+typedef std::function<void(ADGraph &graph)> ADPipelineJob;
+
+// Double-buffered record & propagate pipeline: the caller records into one graph while 
+// a background thread propagates the previous ones and hands them to their jobs 
+// (e.g. to extract the Hessian). The graphs are cleared and reused, so once their memory 
+// has grown to the size of the recordings nothing is allocated.
+//   ADGraph &graph = pipeline.Begin();
+//   ... record f ...
+//   SetAdjoint(f, 1.0);
+//   pipeline.Submit(job);
+// numGraphs is at least 1 (smaller values are clamped), and recording overlaps 
+// the propagation only with 2 graphs or more.
+struct ADPipeline {
+    ADPipeline(const int numGraphs = 2) : active(0), pending(0), stop(false) {
+        const int n = std::max(numGraphs, 1);
+        ADGraph *previous = g_ADGraph;
+        for (int i = 0; i < n; i++) {
+            graphs.push_back(new ADGraph());
+        }
+        g_ADGraph = previous;
+        freeGraphs = graphs;
+        queue.reserve(n);
+        worker = std::thread([this]() { Run(); });
+    }
+    ADPipeline(const ADPipeline&) = delete;
+    ADPipeline& operator=(const ADPipeline&) = delete;
+
+    ~ADPipeline() {
+        Wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        queueChanged.notify_one();
+        worker.join();
+        for (int i = 0; i < (int)graphs.size(); i++) {
+            delete graphs[i];
+        }
+    }
+
+    // Wait for a graph that is not used by the worker, clear it and make it the current graph. 
+    // Calling it again before Submit() starts over with the same graph.
+    inline ADGraph& Begin() {
+        if (active != 0) {
+            active->Clear();
+            active->Activate();
+            return *active;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        graphReleased.wait(lock, [this]() { return !freeGraphs.empty(); });
+        active = freeGraphs.back();
+        freeGraphs.pop_back();
+        lock.unlock();
+        active->Clear();
+        active->Activate();
+        return *active;
+    }
+
+    // Propagate the graph recorded since Begin() in the background, then call job(graph) 
+    // from the worker thread. The graph must not be used by the caller until job returns, 
+    // so it is not the current graph anymore. Returns false without submitting anything 
+    // if there is no graph begun since the last Submit().
+    inline bool Submit(const ADPipelineJob &job) {
+        if (active == 0) {
+            return false;
+        }
+        if (g_ADGraph == active) {
+            g_ADGraph = 0;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(Job(active, job));
+            pending++;
+        }
+        active = 0;
+        queueChanged.notify_one();
+        return true;
+    }
+
+    // Wait for all the submitted jobs
+    inline void Wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        graphReleased.wait(lock, [this]() { return pending == 0; });
+    }
+
+private:
+    typedef std::pair<ADGraph*, ADPipelineJob> Job;
+
+    inline void Run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            queueChanged.wait(lock, [this]() { return stop || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            Job job = std::move(queue.front());
+            queue.erase(queue.begin());
+            lock.unlock();
+            job.first->Activate();
+            PropagateAdjoint();
+            job.second(*job.first);
+            g_ADGraph = 0;
+            lock.lock();
+            freeGraphs.push_back(job.first);
+            pending--;
+            graphReleased.notify_all();
+        }
+    }
+
+    std::vector<ADGraph*> graphs;
+    std::vector<ADGraph*> freeGraphs;
+    ADGraph *active;
+    std::vector<Job> queue;
+    int pending;
+    bool stop;
+    std::mutex mutex;
+    std::condition_variable queueChanged, graphReleased;
+    std::thread worker;
+};
+#endif
+
+} //namespace HAD_NAMESPACE
+
+#undef HAD_NAMESPACE
+#undef HAD_REAL
+#undef HAD_WEIGHT
+#undef HAD_VERTEX_ID
 
 #endif // HAD_H__
@@ -1,4 +1,9 @@
 #include "had.h"
+// a second configuration with float weights & 64-bit vertex ids
+#define HAD_NAMESPACE hadm
+#define HAD_WEIGHT float
+#define HAD_VERTEX_ID unsigned long long
+#include "had.h"
 
 #include <cassert>
 #include <cmath>
@@ -7,6 +12,7 @@ using namespace std;
 using namespace had;
 
 DECLARE_ADGRAPH();
+DECLARE_ADGRAPH_IN(hadm);
 
 #define NearEqualAssert(a, b) \
     assert(std::fabs((a) - (b)) < 1e-8)
@@ -147,6 +153,31 @@ void TestDivision() {
     NearEqualAssert(dydx2x2, (Real(2.0) * x0.val * x0.val) / (x1.val * x2.val * x2.val * x2.val));
 }
 
+void TestSquare() {
+    ADGraph adGraph;
+
+    AReal x0 = AReal(Real(1.0));
+    AReal x1 = AReal(Real(2.0));
+    AReal x2 = AReal(Real(3.0));
+
+    AReal y = square(x0 * x1 + x2);
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjoint();
+
+    const Real u = x0.val * x1.val + x2.val;
+    NearEqualAssert(y.val, u * u);
+    NearEqualAssert(GetAdjoint(x0), Real(2.0) * u * x1.val);
+    NearEqualAssert(GetAdjoint(x1), Real(2.0) * u * x0.val);
+    NearEqualAssert(GetAdjoint(x2), Real(2.0) * u);
+
+    NearEqualAssert(GetAdjoint(x0, x0), Real(2.0) * x1.val * x1.val);
+    NearEqualAssert(GetAdjoint(x0, x1), Real(2.0) * (x0.val * x1.val + u));
+    NearEqualAssert(GetAdjoint(x0, x2), Real(2.0) * x1.val);
+    NearEqualAssert(GetAdjoint(x1, x1), Real(2.0) * x0.val * x0.val);
+    NearEqualAssert(GetAdjoint(x1, x2), Real(2.0) * x0.val);
+    NearEqualAssert(GetAdjoint(x2, x2), Real(2.0));
+}
+
 void TestSqrt() {
     ADGraph adGraph;
 
@@ -400,11 +431,1701 @@ void TestCopy() {
     NearEqualAssert(dydxx, Real(2.0));
 }
 
+void TestStreaming() {
+    ADGraph adGraph;
+    adGraph.streaming = true;
+
+    AReal x0 = AReal(Real(1.0));
+    AReal x1 = AReal(Real(2.0));
+    AReal x2 = AReal(Real(3.0));
+
+    AReal y = x0 * x0 * x1 * x1 * x2;
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjoint();
+
+    NearEqualAssert(GetAdjoint(x0, x0), Real(2.0) * x1.val * x1.val * x2.val);
+    NearEqualAssert(GetAdjoint(x0, x1), Real(4.0) * x0.val * x1.val * x2.val);
+    NearEqualAssert(GetAdjoint(x0, x2), Real(2.0) * x0.val * x1.val * x1.val);
+    NearEqualAssert(GetAdjoint(x1, x1), Real(2.0) * x0.val * x0.val * x2.val);
+    NearEqualAssert(GetAdjoint(x1, x2), Real(2.0) * x0.val * x0.val * x1.val);
+    NearEqualAssert(GetAdjoint(x2, x2), Real(0.0));
+
+    for (VertexId vid = 3; vid < adGraph.vertices.size(); vid++) {
+        assert(adGraph.soEdges[vid].nodes.capacity() == 0);
+        NearEqualAssert(adGraph.selfSoEdges[vid], Real(0.0));
+    }
+}
+
+void TestReplay() {
+    ADGraph adGraph(true);
+
+    AReal x0 = AReal(Real(1.0));
+    AReal x1 = AReal(Real(2.0));
+
+    AReal y = x0 < x1 ? sin(x0 * x1) / x1 : x0 - x1;
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjoint();
+    NearEqualAssert(GetAdjoint(x0, x1), - sin(x0.val * x1.val) * x0.val);
+
+    std::vector<Real> inputs(2);
+    inputs[0] = Real(0.5);
+    inputs[1] = Real(3.0);
+    assert(Replay(inputs));
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjoint();
+
+    Real a = inputs[0], b = inputs[1];
+    NearEqualAssert(GetValue(x0), a);
+    NearEqualAssert(GetValue(y), sin(a * b) / b);
+    NearEqualAssert(GetAdjoint(x0), cos(a * b));
+    NearEqualAssert(GetAdjoint(x1), (a * b * cos(a * b) - sin(a * b)) / (b * b));
+    NearEqualAssert(GetAdjoint(x0, x0), - sin(a * b) * b);
+    NearEqualAssert(GetAdjoint(x0, x1), - sin(a * b) * a);
+    NearEqualAssert(GetAdjoint(x1, x1), 
+        (- a * a * b * b * sin(a * b) - Real(2.0) * a * b * cos(a * b) + Real(2.0) * sin(a * b)) / (b * b * b));
+
+    // the branch taken while recording is not valid anymore
+    inputs[0] = Real(4.0);
+    assert(!Replay(inputs));
+
+    // constants created on the way are not inputs
+    ADGraph constGraph(true);
+    AReal z0 = AReal(Real(1.0));
+    AReal z1 = AReal(Real(2.0));
+    AReal f = Real(0.0);
+    f += z0 * z1;
+    f = z0 < AReal(Real(3.0)) ? f * AReal(Real(2.0)) : f;
+    inputs[0] = Real(1.5);
+    inputs[1] = Real(4.0);
+    assert(Replay(inputs));
+    NearEqualAssert(GetValue(f), Real(12.0));
+    // too many inputs do not change the graph
+    inputs.push_back(Real(5.0));
+    inputs.push_back(Real(6.0));
+    assert(!Replay(inputs));
+    NearEqualAssert(GetValue(z0), Real(1.5));
+    NearEqualAssert(GetValue(f), Real(12.0));
+    SetAdjoint(f, Real(1.0));
+    PropagateAdjoint();
+    NearEqualAssert(GetAdjoint(z0), Real(8.0));
+    NearEqualAssert(GetAdjoint(z0, z1), Real(2.0));
+}
+
+void TestVectorAdjoint() {
+    ADGraph adGraph;
+
+    AReal x0 = AReal(Real(0.4));
+    AReal x1 = AReal(Real(1.3));
+
+    AReal f0 = x0 * x0 * x1;
+    AReal f1 = sin(x0) * x1 + x1 * x1;
+    VectorAdjoint<2> adjoints;
+    adjoints.SetAdjoint(f0, 0, Real(1.0));
+    adjoints.SetAdjoint(f1, 1, Real(1.0));
+    adjoints.PropagateAdjoint();
+
+    Real a = x0.val, b = x1.val;
+    NearEqualAssert(adjoints.GetAdjoint(x0, 0), Real(2.0) * a * b);
+    NearEqualAssert(adjoints.GetAdjoint(x1, 0), a * a);
+    NearEqualAssert(adjoints.GetAdjoint(x0, x0, 0), Real(2.0) * b);
+    NearEqualAssert(adjoints.GetAdjoint(x0, x1, 0), Real(2.0) * a);
+    NearEqualAssert(adjoints.GetAdjoint(x1, x1, 0), Real(0.0));
+
+    NearEqualAssert(adjoints.GetAdjoint(x0, 1), cos(a) * b);
+    NearEqualAssert(adjoints.GetAdjoint(x1, 1), sin(a) + Real(2.0) * b);
+    NearEqualAssert(adjoints.GetAdjoint(x0, x0, 1), - sin(a) * b);
+    NearEqualAssert(adjoints.GetAdjoint(x1, x0, 1), cos(a));
+    NearEqualAssert(adjoints.GetAdjoint(x1, x1, 1), Real(2.0));
+}
+
+AReal EagerFunction(const AReal &x0, const AReal &x1, const AReal &x2) {
+    AReal y = x0 * x1 + sin(x0) * x2 / x1 + exp(x2 * 0.5);
+    AReal z = y * y * x2 - 2.0 / x1;
+    AReal u = sqrt(x0) + x1; // two parents without d^2f/dx^2
+    return z * u + log(x2 * x2);
+}
+
+AReal ExprFunction(const AReal &x0, const AReal &x1, const AReal &x2) {
+    AReal y = Expr(x0) * x1 + sin(Expr(x0)) * x2 / x1 + exp(Expr(x2) * 0.5);
+    AReal z = Expr(y) * y * x2 - 2.0 / Expr(x1);
+    AReal u = Expr(x0) + x1;
+    u = sqrt(Expr(x0)) + 0.0 * Expr(x0) + x1; // merged leaves
+    return z * u + log(square(Expr(x2)));
+}
+
+void TestExpression() {
+    std::vector<AReal> x(3);
+    Real eager[3][3], eagerGrad[3];
+    int eagerSize;
+    {
+        ADGraph adGraph;
+        x[0] = AReal(Real(0.4));
+        x[1] = AReal(Real(1.3));
+        x[2] = AReal(Real(0.7));
+        AReal f = EagerFunction(x[0], x[1], x[2]);
+        eagerSize = adGraph.vertices.size();
+        SetAdjoint(f, Real(1.0));
+        PropagateAdjoint();
+        GetHessian(x, &eager[0][0]);
+        for (int i = 0; i < 3; i++) {
+            eagerGrad[i] = GetAdjoint(x[i]);
+        }
+    }
+
+    ADGraph adGraph;
+    x[0] = AReal(Real(0.4));
+    x[1] = AReal(Real(1.3));
+    x[2] = AReal(Real(0.7));
+    AReal f = ExprFunction(x[0], x[1], x[2]);
+    assert((int)adGraph.vertices.size() < eagerSize);
+    assert(!adGraph.naryVertices.empty());
+    SetAdjoint(f, Real(1.0));
+    PropagateAdjoint();
+    Real hessian[3][3];
+    GetHessian(x, &hessian[0][0]);
+    for (int i = 0; i < 3; i++) {
+        NearEqualAssert(GetAdjoint(x[i]), eagerGrad[i]);
+        for (int j = 0; j < 3; j++) {
+            NearEqualAssert(hessian[i][j], eager[i][j]);
+        }
+    }
+
+    // the same graph with the vector-mode adjoints
+    VectorAdjoint<2> adjoints;
+    adjoints.SetAdjoint(f, 0, Real(1.0));
+    adjoints.SetAdjoint(f, 1, Real(2.0));
+    adjoints.PropagateAdjoint();
+    for (int i = 0; i < 3; i++) {
+        NearEqualAssert(adjoints.GetAdjoint(x[i], 1), Real(2.0) * eagerGrad[i]);
+        for (int j = 0; j < 3; j++) {
+            NearEqualAssert(adjoints.GetAdjoint(x[i], x[j], 0), eager[i][j]);
+            NearEqualAssert(adjoints.GetAdjoint(x[i], x[j], 1), Real(2.0) * eager[i][j]);
+        }
+    }
+
+    // recorded ops fall back to one vertex per operation
+    ADGraph replayGraph(true);
+    AReal a = AReal(Real(0.4));
+    AReal b = AReal(Real(1.3));
+    AReal c = Expr(a) * b + sin(Expr(a));
+    assert(replayGraph.naryVertices.empty());
+    std::vector<Real> inputs;
+    inputs.push_back(Real(0.5));
+    inputs.push_back(Real(2.0));
+    assert(Replay(inputs));
+    NearEqualAssert(GetValue(c), Real(0.5) * Real(2.0) + sin(Real(0.5)));
+}
+
+void TestPattern() {
+    ADGraph adGraph(true);
+    std::vector<AReal> x;
+    x.push_back(AReal(Real(0.4)));
+    x.push_back(AReal(Real(1.3)));
+    x.push_back(AReal(Real(0.7)));
+    AReal f = EagerFunction(x[0], x[1], x[2]) + x[0] * x[0] * x[2];
+
+    ADPattern pattern;
+    pattern.Analyze();
+    assert(pattern.Matches());
+    std::vector<Real> inputs(3);
+    for (int k = 0; k < 3; k++) {
+        inputs[0] = Real(0.4 + 0.1 * k);
+        inputs[1] = Real(1.3 - 0.2 * k);
+        inputs[2] = Real(0.7 + 0.3 * k);
+        assert(Replay(inputs));
+
+        // reference derivatives with the search trees
+        SetAdjoint(f, Real(1.0));
+        PropagateAdjoint();
+        Real gradient[3], hessian[3][3];
+        for (int i = 0; i < 3; i++) {
+            gradient[i] = GetAdjoint(x[i]);
+        }
+        GetHessian(x, &hessian[0][0]);
+        for (int i = 0; i < 3; i++) {
+            SetAdjoint(x[i], Real(0.0));
+        }
+
+        SetAdjoint(f, Real(1.0));
+        pattern.PropagateAdjoint();
+        for (int i = 0; i < 3; i++) {
+            NearEqualAssert(GetAdjoint(x[i]), gradient[i]);
+            for (int j = 0; j < 3; j++) {
+                NearEqualAssert(pattern.GetAdjoint(x[i], x[j]), hessian[i][j]);
+            }
+        }
+        std::vector<HessianEntry> entries;
+        pattern.GetHessianCOO(x, entries);
+        assert(entries.size() == 6);
+        for (int e = 0; e < (int)entries.size(); e++) {
+            NearEqualAssert(entries[e].val, hessian[entries[e].row][entries[e].col]);
+        }
+        for (int i = 0; i < 3; i++) {
+            SetAdjoint(x[i], Real(0.0));
+        }
+    }
+
+    // a different graph does not match
+    x[0] * x[1];
+    assert(!pattern.Matches());
+
+    // the same function recorded again at another point, with n-ary vertices
+    ADGraph exprGraph;
+    for (int k = 0; k < 2; k++) {
+        exprGraph.Clear();
+        x[0] = AReal(Real(0.4 + 0.1 * k));
+        x[1] = AReal(Real(1.3));
+        x[2] = AReal(Real(0.7 - 0.1 * k));
+        f = ExprFunction(x[0], x[1], x[2]);
+        if (k == 0) {
+            pattern.Analyze();
+        }
+        assert(pattern.Matches());
+        SetAdjoint(f, Real(1.0));
+        PropagateAdjoint();
+        Real hessian[3][3];
+        GetHessian(x, &hessian[0][0]);
+        SetAdjoint(f, Real(1.0));
+        pattern.PropagateAdjoint();
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                NearEqualAssert(pattern.GetAdjoint(x[i], x[j]), hessian[i][j]);
+            }
+        }
+    }
+}
+
+void TestTape() {
+    ADGraph adGraph;
+    std::vector<AReal> x;
+    x.push_back(AReal(Real(0.4)));
+    x.push_back(AReal(Real(1.3)));
+    x.push_back(AReal(Real(0.7)));
+    AReal f = EagerFunction(x[0], x[1], x[2]) + ExprFunction(x[0], x[1], x[2]);
+    AReal g = exp(sin(x[1]));
+
+    SetAdjoint(f, Real(1.0));
+    PropagateAdjoint();
+    Real gradient[3], hessian[3][3];
+    for (int i = 0; i < 3; i++) {
+        gradient[i] = GetAdjoint(x[i]);
+        SetAdjoint(x[i], Real(0.0));
+    }
+    GetHessian(x, &hessian[0][0]);
+
+    ADTape tape;
+    tape.Build();
+    tape.SetAdjoint(f, Real(1.0));
+    tape.PropagateAdjoint();
+    Real tapeHessian[3][3];
+    GetHessian(x, &tapeHessian[0][0]);
+    for (int i = 0; i < 3; i++) {
+        NearEqualAssert(tape.GetAdjoint(x[i]), gradient[i]);
+        for (int j = 0; j < 3; j++) {
+            NearEqualAssert(tapeHessian[i][j], hessian[i][j]);
+        }
+    }
+
+    Real a = Real(1.0);
+    VertexId root = tape.SingleEdgePropagate(g.varId, a);
+    assert(root == x[1].varId);
+    NearEqualAssert(a, exp(sin(x[1].val)) * cos(x[1].val));
+}
+
+void TestFirstOrder() {
+    ADGraph adGraph;
+    std::vector<AReal> x;
+    x.push_back(AReal(Real(0.4)));
+    x.push_back(AReal(Real(1.3)));
+    x.push_back(AReal(Real(0.7)));
+    AReal f = EagerFunction(x[0], x[1], x[2]) + ExprFunction(x[0], x[1], x[2]);
+
+    SetAdjoint(f, Real(1.0));
+    PropagateAdjoint();
+    Real gradient[3];
+    for (int i = 0; i < 3; i++) {
+        gradient[i] = GetAdjoint(x[i]);
+        SetAdjoint(x[i], Real(0.0));
+    }
+    adGraph.soEdges.clear();
+    adGraph.selfSoEdges.clear();
+
+    SetAdjoint(f, Real(1.0));
+    PropagateAdjointFirstOrder();
+    for (int i = 0; i < 3; i++) {
+        NearEqualAssert(GetAdjoint(x[i]), gradient[i]);
+    }
+    // no second-order storage
+    assert(adGraph.soEdges.empty() && adGraph.selfSoEdges.empty());
+}
+
+// Value, gradient & row-major Hessian of f(x) at x0, propagated in a new graph. 
+// If recordAt is not empty, the graph records its ops at recordAt and is replayed at x0.
+template <typename F>
+Real GetDerivatives(F f, const std::vector<Real> &x0, std::vector<Real> &gradient, 
+                    std::vector<Real> &hessian, const std::vector<Real> &recordAt) {
+    const bool replay = !recordAt.empty();
+    ADGraph adGraph(replay);
+    std::vector<AReal> x(x0.size());
+    for (size_t i = 0; i < x.size(); i++) {
+        x[i] = AReal(replay ? recordAt[i] : x0[i]);
+    }
+    AReal y = f(x);
+    if (replay) {
+        assert(Replay(x0));
+    }
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjoint();
+    gradient.resize(x.size());
+    hessian.resize(x.size() * x.size());
+    for (size_t i = 0; i < x.size(); i++) {
+        gradient[i] = GetAdjoint(x[i]);
+    }
+    GetHessian(x, hessian.data());
+    return GetValue(y);
+}
+
+// Assert that f(x) has the given value, gradient & Hessian at x0
+template <typename F>
+void AssertDerivatives(F f, const std::vector<Real> &x0, const Real value, 
+                       const std::vector<Real> &gradient, const std::vector<Real> &hessian,
+                       const std::vector<Real> &recordAt = std::vector<Real>()) {
+    std::vector<Real> g, h;
+    NearEqualAssert(GetDerivatives(f, x0, g, h, recordAt), value);
+    for (size_t i = 0; i < g.size(); i++) {
+        NearEqualAssert(g[i], gradient[i]);
+    }
+    for (size_t i = 0; i < h.size(); i++) {
+        NearEqualAssert(h[i], hessian[i]);
+    }
+}
+
+// Assert that f(x) & reference(x) have the same value & derivatives at x0
+template <typename F, typename G>
+void AssertSameDerivatives(F f, G reference, const std::vector<Real> &x0, 
+                           const std::vector<Real> &recordAt = std::vector<Real>()) {
+    std::vector<Real> gradient, hessian;
+    const Real value = GetDerivatives(reference, x0, gradient, hessian, std::vector<Real>());
+    AssertDerivatives(f, x0, value, gradient, hessian, recordAt);
+}
+
+AReal ReductionFunction(const std::vector<AReal> &x, const bool reductions) {
+    std::vector<AReal> y;
+    std::vector<Real> c;
+    for (size_t i = 0; i < x.size(); i++) {
+        y.push_back(sin(x[i]));
+        c.push_back(Real(i) + Real(0.5));
+    }
+    if (reductions) {
+        return Dot(x, y) * SquaredNorm(x) + LinearCombination(c, x) * Sum(y) + Dot(x, x);
+    }
+    AReal dot = x[0] * y[0], norm = square(x[0]), comb = c[0] * x[0], sum = y[0], dot2 = x[0] * x[0];
+    for (size_t i = 1; i < x.size(); i++) {
+        dot += x[i] * y[i];
+        norm += square(x[i]);
+        comb += c[i] * x[i];
+        sum += y[i];
+        dot2 += x[i] * x[i];
+    }
+    return dot * norm + comb * sum + dot2;
+}
+
+void TestReductions() {
+    const int n = 4;
+    std::vector<Real> x0(n), recordAt(n);
+    for (int i = 0; i < n; i++) {
+        x0[i] = Real(0.3) * Real(i + 1);
+        recordAt[i] = Real(0.2) * Real(i) - Real(0.1);
+    }
+    auto scalar = [](const std::vector<AReal> &x) {
+        return ReductionFunction(x, false);
+    };
+    auto reductions = [](const std::vector<AReal> &x) {
+        AReal f = ReductionFunction(x, true);
+        // chains of binary operations when recording for Replay()
+        assert(g_ADGraph->naryVertices.size() == (g_ADGraph->recordOps ? 0 : 5));
+        return f;
+    };
+    AssertSameDerivatives(reductions, scalar, x0);
+    AssertSameDerivatives(reductions, scalar, x0, recordAt);
+
+    // Dot(x, reversed x) + SquaredNorm(x) * Sum(x) + LinearCombination(c, x)
+    Real s = Real(0.0), q = Real(0.0), value = Real(0.0);
+    std::vector<Real> c(n), gradient(n), hessian(n * n);
+    for (int i = 0; i < n; i++) {
+        c[i] = Real(i) - Real(1.5);
+        s += x0[i];
+        q += x0[i] * x0[i];
+        value += x0[i] * x0[n - 1 - i] + c[i] * x0[i];
+    }
+    value += q * s;
+    for (int i = 0; i < n; i++) {
+        gradient[i] = Real(2.0) * x0[n - 1 - i] + Real(2.0) * x0[i] * s + q + c[i];
+        for (int j = 0; j < n; j++) {
+            hessian[i * n + j] = Real(2.0) * (j == n - 1 - i) + Real(2.0) * (x0[i] + x0[j]) + 
+                                 Real(2.0) * s * (i == j);
+        }
+    }
+    AssertDerivatives([&](const std::vector<AReal> &x) {
+        std::vector<AReal> reversed(x.rbegin(), x.rend());
+        return Dot(x, reversed) + SquaredNorm(x) * Sum(x.begin(), x.end()) + LinearCombination(c, x);
+    }, x0, value, gradient, hessian);
+}
+
+// Linear algebra on x (with a repeated variable), as aggregate vertices or scalar operations
+AReal LinearAlgebraFunction(const std::vector<AReal> &x, const bool aggregates) {
+    std::vector<AReal> y(x);
+    y.push_back(x[1]);
+    const size_t n = y.size();
+    std::vector<Real> A(n * n);
+    for (size_t i = 0; i < A.size(); i++) {
+        A[i] = Real(0.1) * Real((i * 7) % 5) - Real(0.2);
+    }
+    if (aggregates) {
+        std::vector<AReal> Ay;
+        MatVec(A, y, Ay);
+        return QuadForm(A, y) + LogSumExp(Ay) * Norm2(y) + Norm2(Ay);
+    }
+    std::vector<AReal> Ay(n);
+    AReal quad = AReal(Real(0.0)), sumExp = AReal(Real(0.0)), norm = AReal(Real(0.0)), normAy = AReal(Real(0.0));
+    for (size_t i = 0; i < n; i++) {
+        Ay[i] = AReal(Real(0.0));
+        for (size_t j = 0; j < n; j++) {
+            Ay[i] += A[i * n + j] * y[j];
+        }
+        quad += y[i] * Ay[i];
+        sumExp += exp(Ay[i]);
+        norm += y[i] * y[i];
+        normAy += Ay[i] * Ay[i];
+    }
+    return quad + log(sumExp) * sqrt(norm) + sqrt(normAy);
+}
+
+void TestLinearAlgebra() {
+    const int n = 4;
+    std::vector<Real> x0(n), recordAt(n);
+    for (int i = 0; i < n; i++) {
+        x0[i] = Real(0.3) * Real(i + 1) - Real(0.5);
+        recordAt[i] = Real(0.2) * Real(i);
+    }
+    // scalar operations, aggregate vertices, and aggregates recorded for Replay()
+    auto scalar = [](const std::vector<AReal> &x) {
+        return LinearAlgebraFunction(x, false);
+    };
+    auto aggregates = [](const std::vector<AReal> &x) {
+        AReal f = LinearAlgebraFunction(x, true);
+        // 5 rows of MatVec, QuadForm, LogSumExp and the 2 norms
+        assert(g_ADGraph->recordOps || g_ADGraph->naryVertices.size() == 9);
+        return f;
+    };
+    AssertSameDerivatives(aggregates, scalar, x0);
+    AssertSameDerivatives(aggregates, scalar, x0, recordAt);
+
+    // x^T A x with the gradient (A + A^T) x & the Hessian A + A^T
+    std::vector<Real> A(n * n), gradient(n), hessian(n * n);
+    for (int i = 0; i < n * n; i++) {
+        A[i] = Real(0.1) * Real((i * 7) % 5) - Real(0.2);
+    }
+    Real value = Real(0.0);
+    for (int i = 0; i < n; i++) {
+        gradient[i] = Real(0.0);
+        for (int j = 0; j < n; j++) {
+            hessian[i * n + j] = A[i * n + j] + A[j * n + i];
+            gradient[i] += hessian[i * n + j] * x0[j];
+            value += x0[i] * A[i * n + j] * x0[j];
+        }
+    }
+    AssertDerivatives([&](const std::vector<AReal> &x) { return QuadForm(A, x); }, 
+                      x0, value, gradient, hessian);
+
+    // sqrt(x^T x) with the gradient u = x / r & the Hessian (I - u u^T) / r
+    Real r = Real(0.0);
+    for (int i = 0; i < n; i++) {
+        r += x0[i] * x0[i];
+    }
+    r = std::sqrt(r);
+    for (int i = 0; i < n; i++) {
+        gradient[i] = x0[i] / r;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            hessian[i * n + j] = (Real(i == j) - gradient[i] * gradient[j]) / r;
+        }
+    }
+    AssertDerivatives([](const std::vector<AReal> &x) { return Norm2(x); }, x0, r, gradient, hessian);
+
+    // log(sum_i exp(x[i])) with the gradient p = softmax(x) & the Hessian diag(p) - p p^T, 
+    // also when recorded at small inputs and replayed at large ones (the shift is not a constant)
+    std::vector<Real> large(n);
+    for (int i = 0; i < n; i++) {
+        large[i] = Real(1000.0) + x0[i];
+    }
+    Real sum = Real(0.0);
+    for (int i = 0; i < n; i++) {
+        sum += std::exp(x0[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        gradient[i] = std::exp(x0[i]) / sum;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            hessian[i * n + j] = gradient[i] * (Real(i == j) - gradient[j]);
+        }
+    }
+    auto logSumExp = [](const std::vector<AReal> &x) { return LogSumExp(x); };
+    AssertDerivatives(logSumExp, x0, std::log(sum), gradient, hessian);
+    AssertDerivatives(logSumExp, large, Real(1000.0) + std::log(sum), gradient, hessian);
+    AssertDerivatives(logSumExp, large, Real(1000.0) + std::log(sum), gradient, hessian, recordAt);
+
+    // the empty sum
+    ADGraph adGraph;
+    assert(GetValue(LogSumExp(std::vector<AReal>())) == Real(0.0));
+}
+
+// k(a, b, c) = a * b * sin(c) with its gradient & Hessian
+Real Kernel(const Real *x, Real *g, Real *h) {
+    const Real s = std::sin(x[2]), c = std::cos(x[2]);
+    g[0] = x[1] * s;
+    g[1] = x[0] * s;
+    g[2] = x[0] * x[1] * c;
+    const Real hessian[9] = {Real(0.0), s, x[1] * c, 
+                             s, Real(0.0), x[0] * c, 
+                             x[1] * c, x[0] * c, - x[0] * x[1] * s};
+    std::copy(hessian, hessian + 9, h);
+    return x[0] * x[1] * s;
+}
+
+// Kernel of args through ExternalFunction() with a dense (sparse false) or a sparse Hessian
+AReal ExternalKernel(const std::vector<AReal> &args, const bool sparse) {
+    Real values[3] = {args[0].val, args[1].val, args[2].val}, g[3], h[9];
+    const Real val = Kernel(values, g, h);
+    if (!sparse) {
+        return ExternalFunction(args, val, g, h);
+    }
+    std::vector<HessianEntry> entries;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j <= i; j++) {
+            if (h[i * 3 + j] != Real(0.0)) {
+                entries.push_back(HessianEntry(i, j, h[i * 3 + j]));
+            }
+        }
+    }
+    return ExternalFunction(args, val, g, entries);
+}
+
+void TestExternalFunction() {
+    const int n = 3;
+    std::vector<Real> x0(n);
+    for (int i = 0; i < n; i++) {
+        x0[i] = Real(0.4) * Real(i + 1);
+    }
+    // external function with a dense or a sparse Hessian against AReal arithmetic
+    for (int k = 1; k < 3; k++) {
+        auto composite = [k](const std::vector<AReal> &x) {
+            // the first variable is used twice
+            std::vector<AReal> args(3);
+            args[0] = x[0];
+            args[1] = x[1] * x[2];
+            args[2] = x[0];
+            AReal y = ExternalKernel(args, k == 2);
+            assert(g_ADGraph->naryVertices.size() == 1);
+            return y * exp(x[1]) + y * y;
+        };
+        AssertSameDerivatives(composite, [](const std::vector<AReal> &x) {
+            AReal y = x[0] * (x[1] * x[2]) * sin(x[0]);
+            return y * exp(x[1]) + y * y;
+        }, x0);
+    }
+
+    // x0 * x1 * sin(x0), where the repeated argument adds up its partials
+    const Real a = x0[0], b = x0[1], s = std::sin(a), c = std::cos(a);
+    std::vector<Real> gradient(2), hessian(4);
+    gradient[0] = b * s + a * b * c;
+    gradient[1] = a * s;
+    hessian[0] = Real(2.0) * b * c - a * b * s;
+    hessian[1] = hessian[2] = s + a * c;
+    hessian[3] = Real(0.0);
+    for (int k = 0; k < 2; k++) {
+        AssertDerivatives([k](const std::vector<AReal> &x) {
+            std::vector<AReal> args(3);
+            args[0] = x[0];
+            args[1] = x[1];
+            args[2] = x[0];
+            return ExternalKernel(args, k == 1);
+        }, std::vector<Real>(x0.begin(), x0.begin() + 2), a * b * s, gradient, hessian);
+    }
+}
+
+// Elementwise functions of x, applied to whole arrays or one element at a time
+AReal ElementwiseFunction(const std::vector<AReal> &x, const bool arrays) {
+    const size_t n = x.size();
+    std::vector<AReal> y(n), z(n);
+    if (arrays) {
+        exp(x.data(), y.data(), n);
+        sin(y.data(), y.data(), n);
+        sqrt(x.data(), z.data(), n);
+        log(z.data(), z.data(), n);
+        pow(z.data(), Real(3.0), z.data(), n);
+        cos(z.data(), z.data(), n);
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            y[i] = sin(exp(x[i]));
+            z[i] = cos(pow(log(sqrt(x[i])), Real(3.0)));
+        }
+    }
+    AReal f = y[0] * z[n - 1];
+    for (size_t i = 1; i < n; i++) {
+        f += y[i] * z[i - 1];
+    }
+    return f;
+}
+
+// Assert the derivatives of sum_i c_i op(x_i) where apply computes op over an array, 
+// and op(x, df, ddf) returns op at x with its first & second derivatives
+template <typename Apply, typename Op>
+void AssertElementwise(Apply apply, Op op) {
+    const int n = 10;
+    std::vector<Real> x0(n), c(n), gradient(n), hessian(n * n, Real(0.0));
+    Real value = Real(0.0);
+    for (int i = 0; i < n; i++) {
+        x0[i] = Real(0.1) + Real(0.07) * Real(i);
+        c[i] = Real(i) - Real(4.5);
+        Real df, ddf;
+        value += c[i] * op(x0[i], df, ddf);
+        gradient[i] = c[i] * df;
+        hessian[i * n + i] = c[i] * ddf;
+    }
+    AssertDerivatives([&](const std::vector<AReal> &x) {
+        std::vector<AReal> y(n);
+        apply(x.data(), y.data(), (size_t)n);
+        return LinearCombination(c, y);
+    }, x0, value, gradient, hessian);
+}
+
+void TestElementwise() {
+    const int n = 300;
+    std::vector<Real> inputs(n), recordAt(n);
+    for (int i = 0; i < n; i++) {
+        inputs[i] = Real(0.5) + Real(i % 7) * Real(0.25);
+        recordAt[i] = inputs[i] * Real(2.0);
+    }
+    // scalar operations, arrays, and arrays recorded at other inputs then replayed
+    auto scalar = [](const std::vector<AReal> &x) {
+        return ElementwiseFunction(x, false);
+    };
+    auto arrays = [](const std::vector<AReal> &x) {
+        return ElementwiseFunction(x, true);
+    };
+    AssertSameDerivatives(arrays, scalar, inputs);
+    AssertSameDerivatives(arrays, scalar, inputs, recordAt);
+
+    typedef void (*Apply)(const AReal*, AReal*, size_t);
+    AssertElementwise((Apply)square, [](Real x, Real &df, Real &ddf) {
+        df = Real(2.0) * x; ddf = Real(2.0); return x * x;
+    });
+    AssertElementwise((Apply)sqrt, [](Real x, Real &df, Real &ddf) {
+        df = Real(0.5) / std::sqrt(x); ddf = - Real(0.25) / (x * std::sqrt(x)); return std::sqrt(x);
+    });
+    AssertElementwise([](const AReal *in, AReal *out, size_t n) { pow(in, Real(2.5), out, n); }, 
+                      [](Real x, Real &df, Real &ddf) {
+        df = Real(2.5) * std::pow(x, Real(1.5)); ddf = Real(3.75) * std::sqrt(x); return std::pow(x, Real(2.5));
+    });
+    AssertElementwise((Apply)exp, [](Real x, Real &df, Real &ddf) {
+        df = ddf = std::exp(x); return std::exp(x);
+    });
+    AssertElementwise((Apply)log, [](Real x, Real &df, Real &ddf) {
+        df = Real(1.0) / x; ddf = - Real(1.0) / (x * x); return std::log(x);
+    });
+    AssertElementwise((Apply)sin, [](Real x, Real &df, Real &ddf) {
+        df = std::cos(x); ddf = - std::sin(x); return std::sin(x);
+    });
+    AssertElementwise((Apply)cos, [](Real x, Real &df, Real &ddf) {
+        df = - std::sin(x); ddf = - std::cos(x); return std::cos(x);
+    });
+    AssertElementwise((Apply)tan, [](Real x, Real &df, Real &ddf) {
+        const Real t = std::tan(x);
+        df = Real(1.0) + t * t; ddf = Real(2.0) * t * df; return t;
+    });
+    AssertElementwise((Apply)asin, [](Real x, Real &df, Real &ddf) {
+        df = Real(1.0) / std::sqrt(Real(1.0) - x * x); ddf = x * df * df * df; return std::asin(x);
+    });
+    AssertElementwise((Apply)acos, [](Real x, Real &df, Real &ddf) {
+        df = - Real(1.0) / std::sqrt(Real(1.0) - x * x); ddf = x * df * df * df; return std::acos(x);
+    });
+}
+
+template <typename T>
+T ConfigurationFunction(const T &x0, const T &x1) {
+    return sin(x0 * x1) / x1 + exp(x0) * x1;
+}
+
+void TestConfigurations() {
+    // both graphs are active at the same time
+    ADGraph adGraph;
+    hadm::ADGraph adGraphM;
+    AReal x0 = AReal(Real(0.7)), x1 = AReal(Real(1.9));
+    hadm::AReal y0 = hadm::AReal(0.7), y1 = hadm::AReal(1.9);
+    AReal f = ConfigurationFunction(x0, x1);
+    hadm::AReal g = ConfigurationFunction(y0, y1);
+    assert(sizeof(hadm::ADVertex().e1.w) == sizeof(float) && sizeof(hadm::VertexId) == 8);
+
+    SetAdjoint(f, Real(1.0));
+    PropagateAdjoint();
+    hadm::SetAdjoint(g, 1.0);
+    hadm::PropagateAdjoint();
+    // the weights are rounded to float, the adjoints are accumulated in double
+    assert(std::fabs(hadm::GetValue(g) - GetValue(f)) < 1e-12);
+    assert(std::fabs(hadm::GetAdjoint(y0) - GetAdjoint(x0)) < 1e-5);
+    assert(std::fabs(hadm::GetAdjoint(y1) - GetAdjoint(x1)) < 1e-5);
+    assert(std::fabs(hadm::GetAdjoint(y0, y1) - GetAdjoint(x0, x1)) < 1e-5);
+    assert(std::fabs(hadm::GetAdjoint(y1, y1) - GetAdjoint(x1, x1)) < 1e-5);
+}
+
+void TestPrune() {
+    for (int k = 0; k < 2; k++) {
+        ADGraph adGraph(k == 1);
+        std::vector<AReal> x;
+        x.push_back(AReal(Real(0.4)));
+        x.push_back(AReal(Real(1.3)));
+        x.push_back(AReal(Real(0.7)));
+        AReal dead0 = cos(x[1]) * x[2];
+        AReal dead2 = Sum(x);
+        std::vector<AReal> x01(x.begin(), x.begin() + 2);
+        AReal f = x[0] < x[1] ? sin(x[0]) * x[1] * x[1] + Sum(x01) : x[0] - x[1];
+        AReal dead1 = exp(f) + x[2];
+        const Real a = x[0].val, b = x[1].val;
+
+        SetAdjoint(f, Real(1.0));
+        const size_t numVertices = adGraph.vertices.size();
+        std::vector<VertexId> newIds;
+        PruneGraph(newIds);
+        // the vertices of dead0, dead1 & dead2 are removed (Sum() is a single n-ary vertex 
+        // unless the operations are recorded), the leaves are kept
+        assert(adGraph.vertices.size() == numVertices - (k == 0 ? 5 : 6));
+        assert(newIds[dead0.varId] == kPrunedVertex && newIds[dead1.varId] == kPrunedVertex && 
+               newIds[dead2.varId] == kPrunedVertex);
+        for (int i = 0; i < 3; i++) {
+            x[i] = Remap(x[i], newIds);
+            assert(x[i].varId == VertexId(i));
+        }
+        f = Remap(f, newIds);
+        NearEqualAssert(GetValue(f), sin(a) * b * b + a + b);
+
+        PropagateAdjoint();
+        NearEqualAssert(GetAdjoint(x[0]), cos(a) * b * b + Real(1.0));
+        NearEqualAssert(GetAdjoint(x[1]), Real(2.0) * sin(a) * b + Real(1.0));
+        NearEqualAssert(GetAdjoint(x[0], x[0]), -sin(a) * b * b);
+        NearEqualAssert(GetAdjoint(x[0], x[1]), Real(2.0) * cos(a) * b);
+        NearEqualAssert(GetAdjoint(x[1], x[1]), Real(2.0) * sin(a));
+        NearEqualAssert(GetAdjoint(x[2]), Real(0.0));
+
+        if (k == 1) {
+            std::vector<Real> inputs(3);
+            inputs[0] = Real(0.9);
+            inputs[1] = Real(1.1);
+            inputs[2] = Real(5.0);
+            assert(Replay(inputs));
+            SetAdjoint(f, Real(1.0));
+            PropagateAdjoint();
+            NearEqualAssert(GetAdjoint(x[0], x[1]), Real(2.0) * cos(Real(0.9)) * Real(1.1));
+            inputs[0] = Real(2.0);
+            assert(!Replay(inputs));
+        }
+    }
+
+    // y = sin(x)^2 + x^2 at x = 0, where the folded vertex drops the zero partial of t 
+    // but keeps its second-order weight
+    ADGraph adGraph;
+    AReal x = AReal(Real(0.0));
+    AReal t = sin(x);
+    AReal y = Expr(t) * t + Expr(x) * x;
+    SetAdjoint(y, Real(1.0));
+    std::vector<VertexId> newIds;
+    PruneGraph(newIds);
+    assert(newIds[t.varId] != kPrunedVertex);
+    x = Remap(x, newIds);
+    PropagateAdjoint();
+    NearEqualAssert(GetAdjoint(x), Real(0.0));
+    NearEqualAssert(GetAdjoint(x, x), Real(4.0));
+}
+
+AReal FuseFunction(const AReal &x0, const AReal &x1) {
+    AReal a = exp(sin(x0 * Real(2.0)));
+    AReal b = log(sqrt(square(x1 - Real(0.5)) + Real(1.0))) / Real(3.0);
+    AReal c = pow(-tan(x0 * x1), Real(2.0)) + Real(2.0) / (x1 + Real(1.0));
+    return a * b + c;
+}
+
+void TestFuseUnary() {
+    std::vector<Real> x0(2);
+    x0[0] = Real(0.3);
+    x0[1] = Real(0.8);
+    size_t numVertices = 0;
+    auto unfused = [&](const std::vector<AReal> &x) {
+        AReal f = FuseFunction(x[0], x[1]);
+        numVertices = g_ADGraph->vertices.size();
+        return f;
+    };
+    auto fused = [&](const std::vector<AReal> &x) {
+        g_ADGraph->fuseUnary = true;
+        AReal f = FuseFunction(x[0], x[1]);
+        // a, b & c are 1, 1 & 4 vertices (tan is applied to a binary vertex), plus the product & the sum
+        assert(g_ADGraph->vertices.size() == 2 + 8 && numVertices > g_ADGraph->vertices.size());
+        return f;
+    };
+    AssertSameDerivatives(fused, unfused, x0);
+
+    // exp(sin(2x)) is a single vertex
+    const Real s = std::sin(Real(2.0) * x0[0]), c = std::cos(Real(2.0) * x0[0]), e = std::exp(s);
+    AssertDerivatives([](const std::vector<AReal> &x) {
+        g_ADGraph->fuseUnary = true;
+        AReal f = exp(sin(x[0] * Real(2.0)));
+        assert(g_ADGraph->vertices.size() == 1 + 1);
+        return f;
+    }, std::vector<Real>(1, x0[0]), e, std::vector<Real>(1, Real(2.0) * c * e), 
+       std::vector<Real>(1, (Real(4.0) * c * c - Real(4.0) * s) * e));
+
+    // the argument is not the last vertex
+    ADGraph adGraph;
+    adGraph.fuseUnary = true;
+    AReal x = AReal(Real(0.5));
+    AReal t = x * Real(2.0);
+    AReal u = t * Real(3.0);
+    AReal y = exp(std::move(t)) + u;
+    assert(adGraph.vertices.size() == 5);
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjoint();
+    NearEqualAssert(GetAdjoint(x, x), Real(4.0) * exp(Real(1.0)));
+}
+
+void TestGraphScope() {
+    ADGraph graph0, graph1;
+    AReal x0, x1, f0, f1;
+    // record the two graphs alternately from the same thread
+    {
+        ADGraphScope scope(graph0);
+        x0 = AReal(Real(0.5));
+    }
+    {
+        ADGraphScope scope(graph1);
+        x1 = AReal(Real(2.0));
+        f1 = x1 * x1 * x1;
+    }
+    assert(g_ADGraph == &graph1);
+    {
+        ADGraphScope scope(graph0);
+        f0 = sin(x0) * x0;
+    }
+    assert(graph0.vertices.size() == 3 && graph1.vertices.size() == 3);
+
+    SetAdjoint(graph1, f1, Real(1.0));
+#ifdef USE_THREADS
+    // propagate graph1 in another thread
+    std::thread worker([&]() { PropagateAdjoint(graph1); });
+    worker.join();
+#else
+    PropagateAdjoint(graph1);
+#endif
+    SetAdjoint(graph0, f0, Real(1.0));
+    PropagateAdjoint(graph0);
+    assert(g_ADGraph == &graph1);
+    NearEqualAssert(GetAdjoint(graph0, x0), cos(Real(0.5)) * Real(0.5) + sin(Real(0.5)));
+    NearEqualAssert(GetAdjoint(graph0, x0, x0), Real(2.0) * cos(Real(0.5)) - sin(Real(0.5)) * Real(0.5));
+    NearEqualAssert(GetAdjoint(graph1, x1), Real(12.0));
+    NearEqualAssert(GetAdjoint(graph1, x1, x1), Real(12.0));
+    SetAdjoint(graph1, f1, Real(1.0));
+    PropagateAdjointFirstOrder(graph1);
+    NearEqualAssert(GetAdjoint(graph1, x1), Real(24.0));
+}
+
+void TestBoundReal() {
+    ADGraph *previous = g_ADGraph;
+    ADGraph graph0, graph1;
+    // record the two graphs statement by statement without a current graph
+    g_ADGraph = 0;
+    ABoundReal x0(graph0, Real(0.5));
+    ABoundReal x1(graph1, Real(2.0));
+    ABoundReal f0 = sin(x0);
+    ABoundReal f1 = x1 * x1;
+    f0 *= x0;
+    f1 = f1 * x1 + Real(1.0);
+    ABoundReal g0 = Real(1.0) - x0 / (x0 + Real(1.0));
+    assert(x1 < f1 && x0 > f0);
+    assert(g_ADGraph == 0);
+    assert(graph0.vertices.size() == 7 && graph1.vertices.size() == 4);
+
+    SetAdjoint(f1, Real(1.0));
+    PropagateAdjoint(graph1);
+    SetAdjoint(f0, Real(1.0));
+    PropagateAdjoint(graph0);
+    NearEqualAssert(GetValue(f0), sin(Real(0.5)) * Real(0.5));
+    NearEqualAssert(GetValue(f1), Real(9.0));
+    NearEqualAssert(GetValue(g0), Real(1.0) / Real(1.5));
+    NearEqualAssert(GetAdjoint(x0), cos(Real(0.5)) * Real(0.5) + sin(Real(0.5)));
+    NearEqualAssert(GetAdjoint(x0, x0), Real(2.0) * cos(Real(0.5)) - sin(Real(0.5)) * Real(0.5));
+    NearEqualAssert(GetAdjoint(x1), Real(12.0));
+    NearEqualAssert(GetAdjoint(x1, x1), Real(12.0));
+
+    // binding a variable of the current graph
+    g_ADGraph = &graph1;
+    AReal y = AReal(Real(3.0));
+    ABoundReal h = exp(ABoundReal(graph1, y));
+    NearEqualAssert(GetValue(h), exp(Real(3.0)));
+    g_ADGraph = previous;
+}
+
+void TestResetDerivatives() {
+    const int n = 4;
+    Real hessians[2][n * n], gradients[2][n];
+    for (int k = 0; k < 2; k++) {
+        ADGraph adGraph;
+        std::vector<AReal> x(n);
+        for (int i = 0; i < n; i++) {
+            x[i] = AReal(Real(0.2) * Real(i + 1));
+        }
+        AReal f = ReductionFunction(x, false);
+        AReal g = EagerFunction(x[0], x[1], x[2]);
+        if (k == 0) {
+            // g alone
+            SetAdjoint(g, Real(1.0));
+            PropagateAdjoint();
+        } else {
+            // a long chain that the seed of g does not reach
+            AReal y = AReal(Real(0.5));
+            for (int i = 0; i < 1000; i++) {
+                y = sin(y) * Real(2.0);
+            }
+            SetAdjoint(f, Real(1.0));
+            PropagateAdjoint();
+            ResetDerivatives();
+            for (int i = 0; i < n; i++) {
+                assert(GetAdjoint(x[i]) == Real(0.0));
+                for (int j = 0; j < n; j++) {
+                    assert(GetAdjoint(x[i], x[j]) == Real(0.0));
+                }
+            }
+            SetAdjoint(g, Real(1.0));
+            PropagateAdjoint();
+            // only the vertices of f & g are reset next time
+            assert(adGraph.soEdgesTracked);
+            assert(adGraph.touchedSoEdges.size() < g.varId);
+            ResetDerivatives();
+            assert(adGraph.touchedSoEdges.empty());
+            SetAdjoint(g, Real(1.0));
+            PropagateAdjoint();
+        }
+        GetHessian(x, hessians[k]);
+        for (int i = 0; i < n; i++) {
+            gradients[k][i] = GetAdjoint(x[i]);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        NearEqualAssert(gradients[1][i], gradients[0][i]);
+    }
+    for (int i = 0; i < n * n; i++) {
+        NearEqualAssert(hessians[1][i], hessians[0][i]);
+    }
+}
+
+void TestReserve() {
+    const int n = 30;
+    ADGraphEstimator estimator;
+    Real hessians[2][n * n];
+    for (int k = 0; k < 2; k++) {
+        ADGraph adGraph;
+        // the second run reserves the marks of the first one
+        estimator.Reserve(adGraph);
+        const ADVertex *vertices = adGraph.vertices.data();
+        const SoEdgeStore *soEdges = adGraph.soEdges.data();
+        const Real *selfSoEdges = adGraph.selfSoEdges.data();
+        const ADEdge *naryEdges = adGraph.naryEdges.data();
+        const size_t capacity = adGraph.arena.Capacity();
+        std::vector<AReal> x(n);
+        for (int i = 0; i < n; i++) {
+            x[i] = AReal(Real(0.1) * Real(i + 1));
+        }
+        AReal f = ReductionFunction(x, true) * ReductionFunction(x, false);
+        SetAdjoint(f, Real(1.0));
+        PropagateAdjoint();
+        GetHessian(x, hessians[k]);
+        if (k == 1) {
+            assert(adGraph.vertices.data() == vertices);
+            assert(adGraph.soEdges.data() == soEdges);
+            assert(adGraph.selfSoEdges.data() == selfSoEdges);
+            assert(adGraph.naryEdges.data() == naryEdges);
+            assert(adGraph.arena.Capacity() == capacity);
+        }
+        estimator.Update(adGraph);
+        assert(estimator.numVertices == adGraph.vertices.size());
+        assert(estimator.arenaBytes > 0);
+    }
+    for (int i = 0; i < n * n; i++) {
+        NearEqualAssert(hessians[1][i], hessians[0][i]);
+    }
+
+    ADGraph adGraph;
+    adGraph.Reserve(1000, 5000);
+    assert(adGraph.vertices.capacity() >= 1000 && adGraph.soEdges.size() >= 1000);
+    assert(adGraph.arena.Capacity() >= 5000 * sizeof(SoEdgeStore::Nodes::value_type));
+}
+
+void TestArena() {
+    {
+        // a first block larger than the first chunk
+        ADArena fresh;
+        const size_t bytes = size_t(ADArena::kMinBlock) << (ADArena::kNumClasses - 1);
+        char *p = (char*)fresh.Allocate(bytes);
+        std::fill(p, p + bytes, char(1));
+        assert(fresh.Capacity() >= bytes);
+        char *q = (char*)fresh.Allocate(16);
+        assert(q >= p + bytes || q + 16 <= p);
+    }
+    ADArena arena;
+    void *a = arena.Allocate(100);
+    void *b = arena.Allocate(100);
+    assert(a != b);
+    // freed blocks are handed out again
+    arena.Deallocate(a, 100);
+    assert(arena.Allocate(128) == a);
+    // and everything after a reset
+    arena.Reset();
+    assert(arena.Allocate(16) == a);
+    // the blocks beyond the size classes are released, even while dropping, 
+    // and handed out again for requests of at most their size
+    const size_t large = size_t(ADArena::kMinBlock) << ADArena::kNumClasses;
+    void *c = arena.Allocate(large);
+    void *d = arena.Allocate(large + 1);
+    assert(arena.largeBlocks.size() == 2);
+    arena.Drop();
+    arena.Deallocate(d, large + 1);
+    arena.Reset();
+    assert(arena.Allocate(large) == c && arena.Allocate(large) == d);
+    assert(arena.largeBlocks.size() == 2);
+
+    ADGraph adGraph;
+    std::vector<AReal> x;
+    for (int i = 0; i < 20; i++) {
+        x.push_back(AReal(Real(0.1) * Real(i + 1)));
+    }
+    AReal f = ReductionFunction(x, false);
+    Real hessian[2][400];
+    for (int k = 0; k < 2; k++) {
+        SetAdjoint(f, Real(1.0));
+        adGraph.streaming = k == 1;
+        PropagateAdjoint();
+        GetHessian(x, hessian[k]);
+    }
+    const size_t capacity = adGraph.arena.Capacity();
+    assert(capacity > 0);
+    SetAdjoint(f, Real(1.0));
+    PropagateAdjoint();
+    // the second-order nodes of the previous sweeps are reused
+    assert(adGraph.arena.Capacity() == capacity);
+    for (int i = 0; i < 20; i++) {
+        for (int j = 0; j < 20; j++) {
+            NearEqualAssert(GetAdjoint(x[i], x[j]), hessian[0][i * 20 + j]);
+            NearEqualAssert(hessian[1][i * 20 + j], hessian[0][i * 20 + j]);
+        }
+    }
+
+    // a vertex with more second-order edges than the largest size class holds
+    ADGraph wideGraph;
+    const int n = 100000;
+    std::vector<AReal> y(n), shuffled(n - 1);
+    for (int i = 0; i < n; i++) {
+        y[i] = AReal(Real(0.5));
+    }
+    // out of order, so that the second-order edges of y[n - 1] do not degenerate into a list
+    for (int i = 0; i < n - 1; i++) {
+        shuffled[i] = y[(i * 7919) % (n - 1)];
+    }
+    AReal g = y[n - 1] * Sum(shuffled);
+    size_t wideCapacity = 0;
+    for (int k = 0; k < 3; k++) {
+        SetAdjoint(g, Real(1.0));
+        PropagateAdjoint();
+        assert(!wideGraph.arena.largeBlocks.empty());
+        // the large blocks of the previous sweeps are reused
+        assert(k == 0 || wideGraph.arena.Capacity() == wideCapacity);
+        wideCapacity = wideGraph.arena.Capacity();
+        NearEqualAssert(GetAdjoint(y[n - 1], y[k]), Real(1.0));
+        NearEqualAssert(GetAdjoint(y[k], y[k + 1]), Real(0.0));
+    }
+    // and reserved by the estimator for a new graph
+    ADGraphEstimator estimator;
+    estimator.Update(wideGraph);
+    assert(estimator.largeBlocks == wideGraph.arena.LargeBlockSizes());
+    ADGraph reservedGraph;
+    estimator.Reserve(reservedGraph);
+    assert(reservedGraph.arena.Capacity() == wideCapacity);
+    std::vector<AReal> z(n);
+    for (int i = 0; i < n; i++) {
+        z[i] = AReal(Real(0.5));
+    }
+    for (int i = 0; i < n - 1; i++) {
+        shuffled[i] = z[(i * 7919) % (n - 1)];
+    }
+    AReal h = z[n - 1] * Sum(shuffled);
+    SetAdjoint(h, Real(1.0));
+    PropagateAdjoint();
+    assert(reservedGraph.arena.Capacity() == wideCapacity);
+    NearEqualAssert(GetAdjoint(z[n - 1], z[0]), Real(1.0));
+}
+
+#ifdef USE_TAPE_FILE
+void TestTapeFile() {
+    const char *path = "test_tape.bin";
+    std::vector<AReal> x;
+    Real gradient[3], hessian[3][3];
+    VertexId f;
+    {
+        ADGraph adGraph;
+        x.push_back(AReal(Real(0.4)));
+        x.push_back(AReal(Real(1.3)));
+        x.push_back(AReal(Real(0.7)));
+        AReal y = EagerFunction(x[0], x[1], x[2]) * ExprFunction(x[0], x[1], x[2]);
+        f = y.varId;
+        SetAdjoint(y, Real(2.0));
+        assert(SaveTape(path, true));
+        PropagateAdjoint();
+        for (int i = 0; i < 3; i++) {
+            gradient[i] = GetAdjoint(x[i]);
+        }
+        GetHessian(x, &hessian[0][0]);
+    }
+
+    ADMappedTape tape;
+    assert(tape.Open(path));
+    for (int k = 0; k < 2; k++) {
+        // the saved seed, then a unit seed with the edges released on the way
+        Real scale = Real(1.0);
+        if (k == 1) {
+            for (int i = 0; i < 3; i++) {
+                tape.SetAdjoint(x[i].varId, Real(0.0));
+            }
+            tape.SetAdjoint(f, Real(1.0));
+            tape.streaming = true;
+            scale = Real(0.5);
+        }
+        tape.PropagateAdjoint();
+        for (int i = 0; i < 3; i++) {
+            NearEqualAssert(tape.GetAdjoint(x[i].varId), scale * gradient[i]);
+            for (int j = 0; j < 3; j++) {
+                NearEqualAssert(tape.GetAdjoint(x[i].varId, x[j].varId), scale * hessian[i][j]);
+            }
+        }
+    }
+    tape.Close();
+    std::remove(path);
+    assert(!tape.Open(path));
+}
+#endif
+
+// The k-th term of a sharded objective of the shared variables x
+AReal ShardTerm(const std::vector<AReal> &x, const int k) {
+    AReal local = AReal(Real(0.1) * Real(k % 5));
+    return exp(x[k % 3] * local) * x[(k + 1) % 3] + sin(x[(k * 7) % 3] * x[(k + 2) % 3]);
+}
+
+void TestHessianWire() {
+    std::vector<Real> x0(3);
+    for (int i = 0; i < 3; i++) {
+        x0[i] = Real(0.2) * Real(i + 1);
+    }
+    const int numNodes = 3, numTerms = 30;
+    // every node records & serializes its own shard
+    std::vector<std::vector<unsigned char> > messages(numNodes);
+    for (int node = 0; node < numNodes; node++) {
+        ADGraph adGraph;
+        std::vector<AReal> x;
+        assert(DeclareVariables(x0, x));
+        assert(!DeclareVariables(x0, x));
+        AReal f = AReal(Real(0.0));
+        for (int k = node; k < numTerms; k += numNodes) {
+            f += ShardTerm(x, k);
+        }
+        SetAdjoint(f, Real(1.0));
+        PropagateAdjoint();
+        HessianAccumulator partial;
+        partial.Reset(3);
+        partial.Accumulate(x);
+        partial.Serialize(messages[node]);
+    }
+    HessianAccumulator result;
+    result.Reset(3);
+    for (int node = 0; node < numNodes; node++) {
+        assert(result.Merge(messages[node].data(), messages[node].size()));
+    }
+    // truncated, wrong size or out of range messages are rejected
+    std::vector<unsigned char> message = messages[0];
+    assert(!result.Merge(message.data(), message.size() - 1));
+    HessianAccumulator other;
+    other.Reset(4);
+    assert(!other.Merge(message.data(), message.size()));
+    // a count of entries whose size wraps around to the size of the message
+    ADHessianWireHeader header;
+    std::copy(message.begin(), message.begin() + sizeof(header), (unsigned char*)&header);
+    header.numEntries += 1ull << (sizeof(unsigned long long) * 8 - 4);
+    std::vector<unsigned char> forged = message;
+    std::copy((unsigned char*)&header, (unsigned char*)&header + sizeof(header), forged.begin());
+    assert(!result.Merge(forged.data(), forged.size()));
+    message[sizeof(ADHessianWireHeader) + 3 * sizeof(Real)] = 0xff; // rows[0]
+    assert(!result.Merge(message.data(), message.size()));
+
+    ADGraph adGraph;
+    std::vector<AReal> x;
+    DeclareVariables(x0, x);
+    AReal f = AReal(Real(0.0));
+    for (int k = 0; k < numTerms; k++) {
+        f += ShardTerm(x, k);
+    }
+    SetAdjoint(f, Real(1.0));
+    PropagateAdjoint();
+    for (int i = 0; i < 3; i++) {
+        NearEqualAssert(result.gradient[i], GetAdjoint(x[i]));
+        for (int j = 0; j < 3; j++) {
+            NearEqualAssert(result.GetHessian(i, j), GetAdjoint(x[i], x[j]));
+        }
+    }
+}
+
+void TestGraphPool() {
+    ADGraphPool pool;
+
+    ADGraph *graph = pool.Acquire();
+    assert(g_ADGraph == graph);
+    std::vector<AReal> x, outputs;
+    for (int k = 0; k < 3; k++) {
+        AReal x0 = AReal(Real(k + 1));
+        AReal x1 = AReal(Real(0.5));
+        x.push_back(x0);
+        x.push_back(x1);
+        outputs.push_back(x0 * x0 * x1);
+    }
+    PropagateAdjoint(outputs);
+    for (int k = 0; k < 3; k++) {
+        const AReal &x0 = x[2 * k], &x1 = x[2 * k + 1];
+        NearEqualAssert(GetAdjoint(x0), Real(2.0) * x0.val * x1.val);
+        NearEqualAssert(GetAdjoint(x1), x0.val * x0.val);
+        NearEqualAssert(GetAdjoint(x0, x0), Real(2.0) * x1.val);
+        NearEqualAssert(GetAdjoint(x0, x1), Real(2.0) * x0.val);
+        NearEqualAssert(GetAdjoint(x1, x1), Real(0.0));
+        // no derivatives across the outputs
+        if (k > 0) {
+            NearEqualAssert(GetAdjoint(x0, x[2 * k - 2]), Real(0.0));
+        }
+    }
+    size_t capacity = graph->vertices.capacity();
+    size_t numSoEdges = graph->soEdges.size();
+    pool.Release(graph);
+    
+    // the memory is kept
+    assert(pool.Acquire() == graph);
+    assert(graph->vertices.size() == 0);
+    assert(graph->vertices.capacity() == capacity);
+    assert(graph->soEdges.size() == numSoEdges);
+    pool.Release(graph);
+}
+
+void TestHessian() {
+    ADGraph adGraph;
+
+    std::vector<AReal> x(4);
+    for (int i = 0; i < 4; i++) {
+        x[i] = AReal(Real(i + 1) * Real(0.3));
+    }
+    // reversed order to make sure the layout does not depend on the vertex ids
+    std::vector<AReal> vars(x.rbegin(), x.rend());
+
+    AReal y = x[0] * x[1] * x[2] + sin(x[3]) * x[0] + x[2] * x[2];
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjoint();
+
+    const int n = 4;
+    Real fullHessian[n * n], lowerHessian[n * n];
+    GetHessian(vars, fullHessian);
+    GetHessian(vars, lowerHessian, HESSIAN_LOWER);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            NearEqualAssert(fullHessian[i * n + j], GetAdjoint(vars[i], vars[j]));
+            NearEqualAssert(lowerHessian[i * n + j], j <= i ? GetAdjoint(vars[i], vars[j]) : Real(0.0));
+        }
+    }
+
+    std::vector<int> rowPtr, cols;
+    std::vector<Real> vals;
+    GetHessianCSR(vars, rowPtr, cols, vals);
+    assert((int)rowPtr.size() == n + 1);
+    for (int i = 0; i < n; i++) {
+        for (int k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+            assert(cols[k] <= i);
+            assert(k == rowPtr[i] || cols[k - 1] < cols[k]);
+            NearEqualAssert(vals[k], GetAdjoint(vars[i], vars[cols[k]]));
+        }
+    }
+    
+    Real v[n] = {Real(1.0), Real(-2.0), Real(0.5), Real(3.0)};
+    Real hv[n];
+    HessianVectorProduct(vars, v, hv);
+    for (int i = 0; i < n; i++) {
+        Real ref = Real(0.0);
+        for (int j = 0; j < n; j++) {
+            ref += fullHessian[i * n + j] * v[j];
+        }
+        NearEqualAssert(hv[i], ref);
+    }
+}
+
+void Step(const std::vector<AReal> &in, std::vector<AReal> &out) {
+    out.push_back(in[0] * in[1]);
+    out.push_back(sin(in[0]) + in[1]);
+    out.push_back(in[2]);
+}
+
+void Objective(const std::vector<AReal> &in, std::vector<AReal> &out) {
+    out.push_back(exp(in[0]) * in[1] + in[2] * in[2]);
+}
+
+void TestHessianVectorProduct() {
+    ADGraph adGraph;
+    std::vector<AReal> x;
+    for (int i = 0; i < 5; i++) {
+        x.push_back(AReal(Real(0.2) * Real(i + 1)));
+    }
+    // binary, unary, n-ary & folded vertices
+    AReal f = ReductionFunction(x, true) + EagerFunction(x[0], x[1], x[2]) + 
+              ExprFunction(x[2], x[3], x[4]) + x[1] * x[1];
+    const int n = 5, m = 3;
+    Real v[m * n], products[m * n];
+    for (int i = 0; i < m * n; i++) {
+        v[i] = Real((i * 7) % 5) - Real(1.5);
+    }
+    SetAdjoint(f, Real(2.0));
+    PropagateHessianVectorProduct(x, v, products, m);
+    // no second-order edges & the seed is kept
+    assert(adGraph.soEdges.empty() && adGraph.selfSoEdges.empty());
+    NearEqualAssert(GetAdjoint(f), Real(2.0));
+
+    PropagateAdjoint();
+    for (int k = 0; k < m; k++) {
+        Real expected[n];
+        HessianVectorProduct(x, v + k * n, expected);
+        for (int i = 0; i < n; i++) {
+            assert(std::fabs(products[k * n + i] - expected[i]) < 1e-8 * std::fabs(expected[i]) + 1e-8);
+        }
+    }
+}
+
+void TestCheckpoint() {
+    ADGraph adGraph;
+
+    std::vector<Real> x0(3);
+    x0[0] = Real(0.3);
+    x0[1] = Real(0.7);
+    x0[2] = Real(1.1);
+
+    ADCheckpointer checkpointer;
+    checkpointer.Begin(x0);
+    for (int k = 0; k < 4; k++) {
+        checkpointer.AddSegment(Step);
+    }
+    checkpointer.AddSegment(Objective);
+    checkpointer.SetAdjoint(0, Real(1.0));
+    checkpointer.PropagateAdjoint();
+
+    // Compare to the derivatives of the whole function recorded at once
+    std::vector<AReal> x(3), in, out;
+    for (int i = 0; i < 3; i++) {
+        x[i] = AReal(x0[i]);
+    }
+    in = x;
+    for (int k = 0; k < 4; k++) {
+        out.clear();
+        Step(in, out);
+        in = out;
+    }
+    out.clear();
+    Objective(in, out);
+    NearEqualAssert(out[0].val, checkpointer.GetState()[0]);
+    SetAdjoint(out[0], Real(1.0));
+    PropagateAdjoint();
+
+    for (int i = 0; i < 3; i++) {
+        NearEqualAssert(checkpointer.adjoint[i], GetAdjoint(x[i]));
+        for (int j = 0; j < 3; j++) {
+            NearEqualAssert(checkpointer.GetHessian(i, j), GetAdjoint(x[i], x[j]));
+        }
+    }
+}
+
+#ifdef USE_THREADS
+AReal Term(const std::vector<AReal> &x, int k) {
+    int i = k % (int)x.size(), j = (k * 7 + 3) % (int)x.size();
+    return exp(x[i] * Real(0.1 * (k % 5))) * x[j] + square(x[i] - x[j]);
+}
+
+void TestParallelPropagate() {
+    std::vector<Real> x0(6);
+    for (int i = 0; i < 6; i++) {
+        x0[i] = Real(0.1) * Real(i + 1);
+    }
+    const int numTerms = 1000;
+    HessianAccumulator result;
+    ParallelPropagateAdjoint(x0, numTerms, Term, result, 4, 64);
+
+    ADGraph adGraph;
+    std::vector<AReal> x(6);
+    for (int i = 0; i < 6; i++) {
+        x[i] = AReal(x0[i]);
+    }
+    AReal y = Term(x, 0);
+    for (int k = 1; k < numTerms; k++) {
+        y = y + Term(x, k);
+    }
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjoint();
+    for (int i = 0; i < 6; i++) {
+        assert(std::fabs(result.gradient[i] - GetAdjoint(x[i])) < 1e-8 * std::fabs(GetAdjoint(x[i])) + 1e-8);
+        for (int j = 0; j < 6; j++) {
+            assert(std::fabs(result.GetHessian(i, j) - GetAdjoint(x[i], x[j])) < 
+                   1e-8 * std::fabs(GetAdjoint(x[i], x[j])) + 1e-8);
+        }
+    }
+}
+
+void TestLevelSchedule() {
+    ADGraph adGraph;
+    std::vector<AReal> x(6);
+    for (int i = 0; i < 6; i++) {
+        x[i] = AReal(Real(0.1) * Real(i + 1));
+    }
+    // a sum of wide terms, an n-ary vertex and a chain
+    AReal y = ReductionFunction(x, true);
+    for (int k = 0; k < 200; k++) {
+        y = y + Term(x, k);
+    }
+    AReal z = x[5];
+    for (int k = 0; k < 50; k++) {
+        z = sin(z) * Real(1.1);
+    }
+    y = y * z;
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjointFirstOrder();
+    Real gradient[6];
+    for (int i = 0; i < 6; i++) {
+        gradient[i] = GetAdjoint(x[i]);
+        SetAdjoint(x[i], Real(0.0));
+    }
+
+    ADLevelSchedule schedule;
+    schedule.Build();
+    // the chain is at least 100 levels deep
+    assert(schedule.levelBegin.size() > 100);
+    for (int numThreads = 1; numThreads <= 3; numThreads++) {
+        SetAdjoint(y, Real(1.0));
+        PropagateAdjointFirstOrder(schedule, numThreads, numThreads == 3 ? 1024 : 1);
+        for (int i = 0; i < 6; i++) {
+            NearEqualAssert(GetAdjoint(x[i]), gradient[i]);
+            SetAdjoint(x[i], Real(0.0));
+        }
+        assert(GetAdjoint(y) == Real(0.0));
+    }
+
+    // the second-order sweep by level gives the Hessian of the serial one
+    SetAdjoint(y, Real(1.0));
+    PropagateAdjoint();
+    Real hessian[36], levelHessian[36];
+    GetHessian(x, hessian);
+    for (int i = 0; i < 6; i++) {
+        NearEqualAssert(GetAdjoint(x[i]), gradient[i]);
+        SetAdjoint(x[i], Real(0.0));
+    }
+    for (int numThreads = 1; numThreads <= 3; numThreads++) {
+        SetAdjoint(y, Real(1.0));
+        PropagateAdjoint(schedule, numThreads, numThreads == 3 ? 1024 : 1);
+        GetHessian(x, levelHessian);
+        for (int i = 0; i < 6; i++) {
+            NearEqualAssert(GetAdjoint(x[i]), gradient[i]);
+            SetAdjoint(x[i], Real(0.0));
+        }
+        for (int i = 0; i < 36; i++) {
+            NearEqualAssert(levelHessian[i], hessian[i]);
+        }
+    }
+
+    // the pairs of vertices in the same level, and a parent used twice
+    std::vector<Real> x0(3);
+    x0[0] = Real(0.3);
+    x0[1] = Real(-0.7);
+    x0[2] = Real(1.2);
+    for (int k = 0; k < 2; k++) {
+        ADGraph graph;
+        std::vector<AReal> v(3);
+        for (int i = 0; i < 3; i++) {
+            v[i] = AReal(x0[i]);
+        }
+        AReal a = sin(v[0] * v[1]), b = exp(v[1] + v[2]), c = v[2] * v[2];
+        AReal g = (a * b) * c + LogSumExp(v) * a;
+        SetAdjoint(g, Real(1.0));
+        if (k == 0) {
+            PropagateAdjoint();
+        } else {
+            ADLevelSchedule levels;
+            levels.Build();
+            PropagateAdjoint(levels, 2, 1);
+        }
+        GetHessian(v, hessian);
+        for (int i = 0; i < 3; i++) {
+            gradient[i] = k == 0 ? GetAdjoint(v[i]) : gradient[i];
+            NearEqualAssert(GetAdjoint(v[i]), gradient[i]);
+        }
+        for (int i = 0; i < 9; i++) {
+            if (k == 0) {
+                levelHessian[i] = hessian[i];
+            }
+            NearEqualAssert(hessian[i], levelHessian[i]);
+        }
+    }
+}
+
+void TestPipeline() {
+    const int numEvaluations = 20;
+    std::vector<Real> values(numEvaluations), hessians(numEvaluations * 4);
+    {
+        ADPipeline pipeline;
+        for (int k = 0; k < numEvaluations; k++) {
+            ADGraph &graph = pipeline.Begin();
+            assert(g_ADGraph == &graph);
+            std::vector<AReal> x;
+            x.push_back(AReal(Real(0.1) * Real(k)));
+            x.push_back(AReal(Real(1.5)));
+            AReal f = sin(x[0] * x[1]) * x[1];
+            SetAdjoint(f, Real(1.0));
+            values[k] = f.val;
+            pipeline.Submit([x, k, &hessians](ADGraph &) {
+                GetHessian(x, &hessians[k * 4]);
+            });
+        }
+        pipeline.Wait();
+    }
+    {
+        // nothing to submit without Begin(), and a second Begin() keeps the same graph
+        ADPipeline pipeline(1);
+        const bool submitted = pipeline.Submit([](ADGraph &) { assert(false); });
+        assert(!submitted);
+        ADGraph &graph = pipeline.Begin();
+        AReal x = AReal(Real(1.0));
+        assert(&pipeline.Begin() == &graph && g_ADGraph == &graph && graph.vertices.empty());
+        x = AReal(Real(2.0));
+        AReal f = x * x;
+        SetAdjoint(f, Real(1.0));
+        Real dfdx = Real(0.0);
+        pipeline.Submit([x, &dfdx](ADGraph &) { dfdx = GetAdjoint(x); });
+        pipeline.Wait();
+        NearEqualAssert(dfdx, Real(4.0));
+        assert(&pipeline.Begin() == &graph);
+    }
+    {
+        // no graph is clamped to one graph
+        ADPipeline pipeline(0);
+        Real dfdx[2] = {Real(0.0), Real(0.0)};
+        for (int k = 0; k < 2; k++) {
+            pipeline.Begin();
+            AReal x = AReal(Real(k + 1));
+            AReal f = x * x;
+            SetAdjoint(f, Real(1.0));
+            pipeline.Submit([x, k, &dfdx](ADGraph &) { dfdx[k] = GetAdjoint(x); });
+        }
+        pipeline.Wait();
+        NearEqualAssert(dfdx[0], Real(2.0));
+        NearEqualAssert(dfdx[1], Real(4.0));
+    }
+    for (int k = 0; k < numEvaluations; k++) {
+        ADGraph adGraph;
+        AReal x0 = AReal(Real(0.1) * Real(k)), x1 = AReal(Real(1.5));
+        AReal f = sin(x0 * x1) * x1;
+        SetAdjoint(f, Real(1.0));
+        PropagateAdjoint();
+        NearEqualAssert(values[k], GetValue(f));
+        NearEqualAssert(hessians[k * 4], GetAdjoint(x0, x0));
+        NearEqualAssert(hessians[k * 4 + 1], GetAdjoint(x0, x1));
+        NearEqualAssert(hessians[k * 4 + 3], GetAdjoint(x1, x1));
+    }
+}
+#endif
+
+void TestBTree() {
+    const int n = 1000;
+    // sorted keys rotate the root at almost every insertion
+    for (int k = 0; k < 2; k++) {
+        BTree tree;
+        for (int i = 0; i < n; i++) {
+            const VertexId key = k == 0 ? i : n - 1 - i;
+            tree.Insert(key, Real(key) + Real(0.5));
+            tree.Insert(key, Real(0.5));
+        }
+        assert((int)tree.nodes.size() == n);
+        for (int i = 0; i < n; i++) {
+            NearEqualAssert(tree.Query(i), Real(i) + Real(1.0));
+        }
+        assert(tree.Query(n) == Real(0.0));
+    }
+}
+#ifdef USE_STATS
+void TestStats() {
+    ADGraph adGraph;
+    AReal x0 = AReal(Real(0.5));
+    AReal x1 = AReal(Real(2.0));
+    AReal x2 = AReal(Real(3.0));
+    AReal f = x0 * x1 * x2 + x0 * x1;
+    f += square(x2);
+    SetAdjoint(f, Real(1.0));
+    PropagateAdjoint();
+
+    const ADStats &stats = adGraph.stats;
+    assert(stats.verticesVisited == 6);
+    assert(stats.leavesSkipped == 2);
+    assert(stats.pushEdgeCalls == 2);
+    assert(stats.insertHits == 1);
+    assert(stats.insertNodes == 4);
+    assert(stats.maxSoEdgeNodes == 2);
+    assert(stats.totalSoEdgeNodes == 4);
+    assert(stats.selfSoEdgeNonzeros == 1);
+
+    // the counters are reset by every sweep
+    PropagateAdjoint();
+    assert(stats.verticesVisited == 6);
+    assert(stats.insertNodes == 0);
+}
+#endif
+
+void TestHashMap() {
+    HashMap hashMap;
+
+    NearEqualAssert(hashMap.Query(VertexId(3)), Real(0.0));
+    for (int i = 0; i < 100; i++) {
+        hashMap.Insert(VertexId(i * 7), Real(i));
+    }
+    for (int i = 0; i < 100; i++) {
+        hashMap.Insert(VertexId(i * 7), Real(1.0));
+    }
+    assert(hashMap.nodes.size() == 100);
+    for (int i = 0; i < 100; i++) {
+        NearEqualAssert(hashMap.Query(VertexId(i * 7)), Real(i + 1));
+    }
+    NearEqualAssert(hashMap.Query(VertexId(1)), Real(0.0));
+
+    hashMap.Clear();
+    assert(hashMap.nodes.size() == 0);
+    NearEqualAssert(hashMap.Query(VertexId(7)), Real(0.0));
+}
+
 int main(int argc, char *argv[]) {
     TestAdd();
     TestMinus();
     TestMultiply();
     TestDivision();
+    TestSquare();
     TestSqrt();
     TestPow();
     TestExp();
@@ -415,6 +2136,43 @@ int main(int argc, char *argv[]) {
     TestASin();
     TestACos();
     TestCopy();
+    TestStreaming();
+    TestReplay();
+    TestVectorAdjoint();
+    TestExpression();
+    TestPattern();
+    TestTape();
+    TestFirstOrder();
+    TestReductions();
+    TestLinearAlgebra();
+    TestExternalFunction();
+    TestArena();
+    TestReserve();
+    TestElementwise();
+    TestConfigurations();
+    TestPrune();
+    TestFuseUnary();
+    TestGraphScope();
+    TestBoundReal();
+    TestResetDerivatives();
+#ifdef USE_TAPE_FILE
+    TestTapeFile();
+#endif
+    TestGraphPool();
+    TestHessianWire();
+    TestHessian();
+    TestHessianVectorProduct();
+    TestCheckpoint();
+#ifdef USE_THREADS
+    TestParallelPropagate();
+    TestPipeline();
+    TestLevelSchedule();
+#endif
+    TestBTree();
+    TestHashMap();
+#ifdef USE_STATS
+    TestStats();
+#endif
     
     return 0;
 }
\ No newline at end of file